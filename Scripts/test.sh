@@ -36,6 +36,20 @@ function getrate {
    echo "AFINFO_RATE=${AFINFO_RATE}" >> "${LOGFILE}"
 }
 
+function result {
+   # prints and logs "label : OK" when status is 0, "label : FAIL" otherwise
+   label="$1"
+   status="$2"
+
+   if [ ${status} -eq 0 ] ; then
+      echo "${label} : OK"
+      echo "${label} : OK" >> "${LOGFILE}"
+   else
+      echo "${label} : FAIL"
+      echo "${label} : FAIL" >> "${LOGFILE}"
+   fi
+}
+
 while getopts p opt; do
    case ${opt} in
       p)
@@ -103,3 +117,313 @@ for file in `find "${TEST_DIR}" \( -iname \*.aif -o -iname \*.aifc -o -iname \*.
 
 done
 
+
+# Sample rate conversion: convert each file to CONVERT_RATE and check afinfo reports the new rate and
+# that the sample frame count scaled with it. Files in formats -c does not handle produce no output file.
+
+CONVERT_RATE=48000
+
+for file in `find "${TEST_DIR}" \( -iname \*.aif -o -iname \*.aifc -o -iname \*.snd \) -type f -print` ; do
+
+   echo "---------------------"
+   echo "---------------------" >> "${LOGFILE}"
+   echo "${file}: -c ${CONVERT_RATE}" >> "${LOGFILE}"
+   echo "${file}: -c ${CONVERT_RATE}"
+
+   converted="${file%.*}-${CONVERT_RATE}.${file##*.}"
+   rm -f "${converted}"
+
+   IN_INFO=$(./affix -v "${file}" 2>> "${LOGFILE}")
+   IN_FRAMES=$(echo "${IN_INFO}" | cut -f3)
+   IN_RATE=$(echo "${IN_INFO}" | cut -f5)
+
+   ./affix -c ${CONVERT_RATE} "${file}" >> "${LOGFILE}" 2>&1
+
+   if [ ! -f "${converted}" ] ; then
+      echo "${CONVERT_RATE} : SKIPPED (format not converted)"
+      echo "${CONVERT_RATE} : SKIPPED (format not converted)" >> "${LOGFILE}"
+      continue
+   fi
+
+   getrate "${converted}"
+
+   OUT_FRAMES=$(./affix -v "${converted}" 2>> "${LOGFILE}" | cut -f3)
+   EXPECTED_FRAMES=$(( (IN_FRAMES * CONVERT_RATE + IN_RATE / 2) / IN_RATE ))
+   echo "IN_FRAMES=${IN_FRAMES} IN_RATE=${IN_RATE} OUT_FRAMES=${OUT_FRAMES} EXPECTED_FRAMES=${EXPECTED_FRAMES}" >> "${LOGFILE}"
+
+   if [ ${AFINFO_RATE} -eq ${CONVERT_RATE} ] && [ $(( OUT_FRAMES - EXPECTED_FRAMES )) -le 1 ] && [ $(( EXPECTED_FRAMES - OUT_FRAMES )) -le 1 ] ; then
+      echo "${CONVERT_RATE} : OK"
+      echo "${CONVERT_RATE} : OK" >> "${LOGFILE}"
+   else
+      echo "${CONVERT_RATE} : FAIL"
+      echo "${CONVERT_RATE} : FAIL" >> "${LOGFILE}"
+   fi
+
+   rm -f "${converted}"
+
+done
+
+
+# Splicing: split each M1F1 file in three, check the parts with -v -x, trim out 1000 frames, then concat the
+# parts and check the result is the same as concat of the whole file (both write fresh headers).
+
+for file in "${TEST_DIR}"/M1F1-*.aif ; do
+
+   echo "---------------------"
+   echo "---------------------" >> "${LOGFILE}"
+   echo "${file}: split, trim, concat" >> "${LOGFILE}"
+   echo "${file}: split, trim, concat"
+
+   FRAMES=$(./affix -v "${file}" 2>> "${LOGFILE}" | cut -f3)
+   parts=("${file%.*}-1.${file##*.}" "${file%.*}-2.${file##*.}" "${file%.*}-3.${file##*.}")
+   trimmed="${file%.*}-trim.${file##*.}"
+   joined="${file%.*}-joined.${file##*.}"
+   whole="${file%.*}-whole.${file##*.}"
+
+   if ! ./affix split "${file}" $(( FRAMES / 3 )) $(( FRAMES * 2 / 3 )) >> "${LOGFILE}" 2>&1 ; then
+      result "split" 1
+      continue
+   fi
+
+   VERIFIED=$(./affix -v -x "${parts[@]}" 2>> "${LOGFILE}" | tee -a "${LOGFILE}" | grep -c "verify	ok")
+   PART_FRAMES=0
+   for n in $(./affix -v "${parts[@]}" 2>> "${LOGFILE}" | cut -f3) ; do
+      PART_FRAMES=$(( PART_FRAMES + n ))
+   done
+   [ ${VERIFIED} -eq 3 ] && [ ${PART_FRAMES} -eq ${FRAMES} ]
+   result "split" $?
+
+   ./affix trim -o "${trimmed}" "${file}" 1000 2000 >> "${LOGFILE}" 2>&1
+   VERIFIED=$(./affix -v -x "${trimmed}" 2>> "${LOGFILE}" | tee -a "${LOGFILE}" | grep -c "verify	ok")
+   TRIM_FRAMES=$(./affix -v "${trimmed}" 2>> "${LOGFILE}" | cut -f3)
+   [ ${VERIFIED} -eq 1 ] && [ "${TRIM_FRAMES}" = "1000" ]
+   result "trim" $?
+
+   ./affix concat -o "${joined}" "${parts[@]}" >> "${LOGFILE}" 2>&1
+   ./affix concat -o "${whole}" "${file}" >> "${LOGFILE}" 2>&1
+   VERIFIED=$(./affix -v -x "${joined}" 2>> "${LOGFILE}" | tee -a "${LOGFILE}" | grep -c "verify	ok")
+   [ ${VERIFIED} -eq 1 ] && cmp "${joined}" "${whole}" >> "${LOGFILE}" 2>&1
+   result "concat" $?
+
+   rm -f "${parts[@]}" "${trimmed}" "${joined}" "${whole}"
+
+done
+
+
+# Tagging: the first tag of a file without padding is appended, the next one fits in place, and with data after
+# the FORM there is no room at the end so the file is rewritten with that data kept.
+
+tagged="${TEST_DIR}/tag-test.aif"
+cp "${TEST_DIR}/M1F1-int16-AFsp.aif" "${tagged}"
+
+echo "---------------------"
+echo "---------------------" >> "${LOGFILE}"
+echo "${tagged}: tag" >> "${LOGFILE}"
+echo "${tagged}: tag"
+
+HOW=$(./affix tag -N "first name" -R "(c) affix" "${tagged}" 2>> "${LOGFILE}" | tee -a "${LOGFILE}" | cut -f3)
+VERIFIED=$(./affix -x "${tagged}" 2>> "${LOGFILE}" | tee -a "${LOGFILE}" | grep -c "verify	ok")
+[ "${HOW}" = "appended" ] && [ ${VERIFIED} -eq 1 ] && grep -q "first name" "${tagged}"
+result "tag appended" $?
+
+HOW=$(./affix tag -N "second name" -m "a comment" "${tagged}" 2>> "${LOGFILE}" | tee -a "${LOGFILE}" | cut -f3)
+VERIFIED=$(./affix -x "${tagged}" 2>> "${LOGFILE}" | tee -a "${LOGFILE}" | grep -c "verify	ok")
+[ "${HOW}" = "in place" ] && [ ${VERIFIED} -eq 1 ] && grep -q "second name" "${tagged}" && ! grep -q "first name" "${tagged}"
+result "tag in place" $?
+
+printf "TRAILING" >> "${tagged}"
+LONG_TEXT=$(printf "%8000s" "" | tr " " "x")
+HOW=$(./affix tag -a "${LONG_TEXT}" "${tagged}" 2>> "${LOGFILE}" | tee -a "${LOGFILE}" | cut -f3)
+FRAMES=$(./affix -v "${tagged}" 2>> "${LOGFILE}" | cut -f3)
+[ "${HOW}" = "rewritten" ] && [ "${FRAMES}" = "23493" ] && [ "$(tail -c 8 "${tagged}")" = "TRAILING" ] && grep -q "second name" "${tagged}"
+result "tag rewritten" $?
+
+rm -f "${tagged}"
+
+
+# Verify: the Perverse files each have a known problem, and -x must never report ok for a file -v rejects.
+
+echo "---------------------"
+echo "---------------------" >> "${LOGFILE}"
+echo "verify" >> "${LOGFILE}"
+echo "verify"
+
+function verifyExpect {
+   # verifyExpect file pattern: -x output for file matches pattern
+   VERIFY_OUT=$(./affix -x "$1" 2>> "${LOGFILE}" | grep "	verify	" | tee -a "${LOGFILE}")
+   echo "${VERIFY_OUT}" | grep -q "$2"
+   result "-x $(basename "$1")" $?
+}
+
+verifyExpect "${TEST_DIR}/Perverse/Fnonull.aif" "truncated: 'FORM' chunk size needs 100 bytes, file is 99 bytes"
+verifyExpect "${TEST_DIR}/Perverse/Ptjunk.aif" "bytes after the end of the 'FORM' chunk"
+verifyExpect "${TEST_DIR}/Perverse/Porder.aif" "'SSND' chunk has 6 bytes more than the 9 sample frames"
+verifyExpect "${TEST_DIR}/Perverse/Pnossnd.aif" "verify	ok"
+verifyExpect "${TEST_DIR}/Stanford/wood24.aiff" "verify	ok"
+
+truncated="${TEST_DIR}/truncated.aif"
+head -c 50000 "${TEST_DIR}/M1F1-int16-AFsp.aif" > "${truncated}"
+verifyExpect "${truncated}" "truncated: 'SSND' chunk at offset"
+head -c 6 "${TEST_DIR}/M1F1-int16-AFsp.aif" > "${truncated}"
+verifyExpect "${truncated}" "too short for a 'FORM' chunk"
+# a second copy of the 26 byte COMM chunk that follows the 12 byte FORM header
+{ head -c 38 "${TEST_DIR}/M1F1-int16-AFsp.aif" ; tail -c +13 "${TEST_DIR}/M1F1-int16-AFsp.aif" ; } > "${truncated}"
+verifyExpect "${truncated}" "2 'COMM' chunks, only one is allowed"
+rm -f "${truncated}"
+
+for file in `find "${TEST_DIR}" \( -iname \*.aif -o -iname \*.aifc -o -iname \*.snd \) -type f -print` ; do
+   if [ -z "$(./affix -v "${file}" 2>> "${LOGFILE}")" ] ; then
+      ! ./affix -x "${file}" 2>> "${LOGFILE}" | tee -a "${LOGFILE}" | grep -q "verify	ok"
+      result "-x $(basename "${file}") rejected by -v" $?
+   fi
+done
+
+
+# Catalog and query: the files each query finds must be the ones awk picks out of a -v scan of the same files.
+# Columns of -v: name, channels, frames, bits, rate, form, compression name.
+
+catalog="${TARGET_BUILD_DIR}/test.catalog"
+files=$(find "${TEST_DIR}" \( -iname \*.aif -o -iname \*.aifc -o -iname \*.snd \) -type f -print)
+SCAN=$(./affix -v -k "${catalog}" ${files} 2>> "${LOGFILE}")
+
+echo "---------------------"
+echo "---------------------" >> "${LOGFILE}"
+echo "query" >> "${LOGFILE}"
+echo "query"
+
+function queryExpect {
+   # queryExpect predicate awk_condition: files matching predicate are the scanned files matching awk_condition
+   QUERY_OUT=$(./affix query -k "${catalog}" "$1" 2>> "${LOGFILE}" | sort)
+   AWK_OUT=$(echo "${SCAN}" | awk -F '\t' "$2 { print \$1 }" | sort)
+   echo "query '$1': ${QUERY_OUT}" >> "${LOGFILE}"
+   [ -n "${AWK_OUT}" ] && [ "${QUERY_OUT}" = "${AWK_OUT}" ]
+   result "query '$1'" $?
+}
+
+queryExpect "rate == 44100" '$5 == 44100'
+queryExpect "channels == 1 && bits > 8" '$2 == 1 && $4 > 8'
+queryExpect "!(form == AIFC) || frames < 1000" '$6 != "AIFC" || $3 < 1000'
+queryExpect "(rate != 8000 && channels == 2) || bits == 24" '($5 != 8000 && $2 == 2) || $4 == 24'
+
+# A damaged catalog is refused, not read past its end.
+
+head -c $(( $(wc -c < "${catalog}") / 2 )) "${catalog}" > "${catalog}.damaged"
+! ./affix query -k "${catalog}.damaged" "rate > 0" >> "${LOGFILE}" 2>&1
+result "query damaged catalog" $?
+rm -f "${catalog}.damaged"
+
+# -k with -s records the rate after the reset.
+
+reset="${TEST_DIR}/query-reset.aif"
+cp "${TEST_DIR}/Stanford/wood12.aiff" "${reset}"
+./affix -s 22050 -k "${catalog}" "${reset}" >> "${LOGFILE}" 2>&1
+[ "$(./affix query -k "${catalog}" "rate == 22050" 2>> "${LOGFILE}")" = "${reset}" ]
+result "query after -s" $?
+rm -f "${reset}" "${catalog}"
+
+
+# Sharded, checkpointed runs: two shards, the first one cut off part way through a record as a crash would leave
+# it, resumed, then merged must print exactly what a single unsharded run prints. Checkpoints written with other
+# options must be refused.
+
+echo "---------------------"
+echo "---------------------" >> "${LOGFILE}"
+echo "checkpoint" >> "${LOGFILE}"
+echo "checkpoint"
+
+checkpoint="${TARGET_BUILD_DIR}/test.checkpoint"
+files=$(find "${TEST_DIR}" \( -iname \*.aif -o -iname \*.aifc -o -iname \*.snd \) -type f -print)
+rm -f "${checkpoint}".*
+
+./affix -v ${files} > "${checkpoint}.single" 2>> "${LOGFILE}"
+./affix -v -S 0/2 -C "${checkpoint}.0" ${files} > /dev/null 2>> "${LOGFILE}"
+./affix -v -S 1/2 -C "${checkpoint}.1" ${files} > /dev/null 2>> "${LOGFILE}"
+
+SIZE=$(wc -c < "${checkpoint}.0")
+head -c $(( SIZE - 20 )) "${checkpoint}.0" > "${checkpoint}.cut"
+mv "${checkpoint}.cut" "${checkpoint}.0"
+./affix -v -S 0/2 -C "${checkpoint}.0" ${files} > /dev/null 2>> "${LOGFILE}"
+
+./affix -M "${checkpoint}.0" "${checkpoint}.1" > "${checkpoint}.merged" 2>> "${LOGFILE}"
+cmp "${checkpoint}.single" "${checkpoint}.merged" >> "${LOGFILE}" 2>&1
+result "checkpoint resume and merge" $?
+
+cp "${checkpoint}.0" "${checkpoint}.before"
+! ./affix -S 0/2 -C "${checkpoint}.0" ${files} > /dev/null 2>> "${LOGFILE}" && cmp -s "${checkpoint}.0" "${checkpoint}.before"
+result "checkpoint resume with other options refused" $?
+
+./affix -S 1/2 -C "${checkpoint}.other" ${files} > /dev/null 2>> "${LOGFILE}"
+! ./affix -M "${checkpoint}.0" "${checkpoint}.other" > /dev/null 2>> "${LOGFILE}"
+result "checkpoint merge with other options refused" $?
+
+rm -f "${checkpoint}".*
+
+
+# Peaks: M1F1-int16-AFsp.aif is 2 channels, 23493 frames at 8000 Hz, so its peak file has a 24 byte header,
+# three 16 byte level headers (256, 1024 and 4096 frames per bin: 92, 23 and 6 bins, data from offset 72) and
+# 121 bins of two channels of 16 bit minimum and maximum, 1040 bytes in all. -n writes nothing.
+
+echo "---------------------"
+echo "---------------------" >> "${LOGFILE}"
+echo "peaks" >> "${LOGFILE}"
+echo "peaks"
+
+peaks="${TEST_DIR}/M1F1-int16-AFsp.aif.peaks"
+EXPECTED_HEADER="4146504b0001000200005bc50000000340bf4000000000000000010000"
+EXPECTED_HEADER="${EXPECTED_HEADER}00005c000000000000004800000400000000170000000000000328"
+EXPECTED_HEADER="${EXPECTED_HEADER}000010000000000600000000000003e0"
+rm -f "${peaks}"
+
+./affix -p -n "${TEST_DIR}/M1F1-int16-AFsp.aif" >> "${LOGFILE}" 2>&1
+[ ! -f "${peaks}" ]
+result "peaks -n" $?
+
+./affix -p "${TEST_DIR}/M1F1-int16-AFsp.aif" >> "${LOGFILE}" 2>&1
+HEADER=$(head -c 72 "${peaks}" | xxd -p | tr -d '\n')
+echo "HEADER=${HEADER}" >> "${LOGFILE}"
+[ "$(wc -c < "${peaks}")" -eq 1040 ] && [ "${HEADER}" = "${EXPECTED_HEADER}" ]
+result "peaks" $?
+rm -f "${peaks}"
+
+
+# I/O budget: runs under -I or -B must take at least as long as the budget allows, less the quarter second burst,
+# and print what an unlimited run prints. The 15 M1F1 files cost at least a stat(), access(), open() and read each,
+# so -I 20 needs 60 operations, over 2.5 seconds. -p reads the 94108 bytes of M1F1-int16-AFsp.aif, so -B 40k needs
+# over 2 seconds. -L without -I or -B, and an unknown -P priority, are refused.
+
+echo "---------------------"
+echo "---------------------" >> "${LOGFILE}"
+echo "I/O budget" >> "${LOGFILE}"
+echo "I/O budget"
+
+budget="${TARGET_BUILD_DIR}/test.budget"
+files=$(find "${TEST_DIR}" -maxdepth 1 -iname M1F1\*.aif -type f -print)
+TIMEFORMAT=%R
+
+./affix -v ${files} > "${budget}.free" 2>> "${LOGFILE}"
+ELAPSED=$( { time ./affix -v -I 20 ${files} > "${budget}.iops" 2>> "${LOGFILE}" ; } 2>&1 )
+echo "ELAPSED=${ELAPSED}" >> "${LOGFILE}"
+awk -v t="${ELAPSED}" 'BEGIN { exit !(t >= 2.5) }' && cmp "${budget}.free" "${budget}.iops" >> "${LOGFILE}" 2>&1
+result "-I iops" $?
+
+peaks="${TEST_DIR}/M1F1-int16-AFsp.aif.peaks"
+./affix -p "${TEST_DIR}/M1F1-int16-AFsp.aif" >> "${LOGFILE}" 2>&1
+mv "${peaks}" "${budget}.peaks"
+ELAPSED=$( { time ./affix -p -B 40k "${TEST_DIR}/M1F1-int16-AFsp.aif" >> "${LOGFILE}" 2>&1 ; } 2>&1 )
+echo "ELAPSED=${ELAPSED}" >> "${LOGFILE}"
+awk -v t="${ELAPSED}" 'BEGIN { exit !(t >= 2) }' && cmp "${budget}.peaks" "${peaks}" >> "${LOGFILE}" 2>&1
+result "-B bytesPerSecond" $?
+rm -f "${peaks}"
+
+! ./affix -v -L 20 ${files} > /dev/null 2>> "${LOGFILE}"
+result "-L without -I or -B refused" $?
+
+! ./affix -v -P fastest ${files} > /dev/null 2>> "${LOGFILE}"
+result "-P unknown priority refused" $?
+
+./affix -v -I 1000 -L 20 -P utility ${files} > "${budget}.utility" 2>> "${LOGFILE}"
+cmp "${budget}.free" "${budget}.utility" >> "${LOGFILE}" 2>&1
+result "-L latency and -P priority" $?
+
+unset TIMEFORMAT
+rm -f "${budget}".*
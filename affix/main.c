@@ -30,6 +30,13 @@
 #import <CoreServices/CoreServices.h>
 #include <sys/stat.h>   // stat()
 #include <libgen.h>     // basename()
+#include <pthread.h>    // pthread_create()
+#include <stdarg.h>     // va_list
+#include <sys/resource.h> // setiopolicy_np()
+#include <sys/mman.h>   // mmap()
+#include <ctype.h>      // isalpha()
+#include <sys/clonefile.h> // clonefile()
+#include <copyfile.h>   // fcopyfile()
 #include "version.h"
 
 // global option flags
@@ -37,6 +44,12 @@ Boolean verboseOpt      = FALSE;
 Boolean debugOpt        = FALSE;
 Boolean noWriteOpt      = FALSE;
 Boolean sampleRateOpt   = FALSE;
+Boolean convertOpt      = FALSE;
+Boolean shardOpt        = FALSE;
+Boolean mergeOpt        = FALSE;
+Boolean ioBudgetOpt     = FALSE;
+Boolean peaksOpt        = FALSE;
+Boolean verifyOpt       = FALSE;
 
 // global flags
 Boolean foundEOF        = FALSE;
@@ -44,6 +57,7 @@ Boolean invalidFile     = FALSE;
 Boolean aiffIsCompressed;
 
 char * fileName; // global -- file we are currently processing
+char * programName; // global -- basename of argv[0], for usage() from the subcommands
 
 // Supplements to structures and pointers in AIFF.h
 // e.g. ...*.sdk/System/Library/Frameworks/CoreServices.framework/Versions/A/Frameworks/CarbonCore.framework/Versions/A/Headers/AIFF.h
@@ -58,6 +72,115 @@ FormatVersionChunkPtr       formatVersionChunkPtr;
 
 size_t maxChunkSize = sizeof(ExtCommonChunk) + 255;        // 255 extra bytes for Pascal string.
 
+// The chunk buffer above is recycled for every chunk, so keep copies of the COMM chunk and SSND chunk
+// header for anything that needs to come back to the sample data after the chunk walk is done.
+ExtCommonChunkPtr           savedCommonChunkPtr;
+SoundDataChunk              savedSoundDataChunk;
+off_t                       soundDataChunkOffset;           // file offset of the SSND chunk header, 0 if none found
+
+// Where each chunk the walk found is in the file, for checks and edits that need the layout rather than the contents.
+typedef struct ChunkTableEntry {
+    UInt32      ckID;                   // host byte order
+    off_t       offset;                 // file offset of the chunk header
+    UInt32      ckSize;                 // host byte order, excludes the header and any pad byte
+} ChunkTableEntry;
+
+ChunkTableEntry *           chunkTable;
+int                         numChunkTableEntries;
+int                         chunkTableCapacity;
+UInt32                      formChunkSize;                  // FORM ckSize, host byte order
+
+// Sample data layout worked out from the COMM chunk (and AIFF-C compression type).
+typedef struct SampleFormat {
+    UInt16      numChannels;
+    UInt32      numSampleFrames;
+    UInt16      sampleSize;             // bits per sample as stored in COMM
+    UInt16      bytesPerSample;         // sampleSize rounded up to whole bytes, samples are left justified
+    Boolean     isFloat;
+    Boolean     isLittleEndian;         // 'sowt' and friends
+    long double sampleRate;
+} SampleFormat;
+
+// Sample rate conversion (-c option)
+// Windowed-sinc (Kaiser) interpolation from a polyphase table, linearly interpolating between adjacent phases.
+// With these values the stopband is roughly 100 dB down and the passband reaches 94% of the lower Nyquist.
+enum {
+    kResamplePhases         = 512,      // filter phases per input sample
+    kResampleZeroCrossings  = 64,       // sinc zero crossings either side of centre, scaled up when downsampling
+    kResampleBlockFrames    = 65536     // input frames read per block, memory use does not depend on file length
+};
+const double resampleCutoff = 0.94;
+const double resampleKaiserBeta = 10.0;
+
+typedef struct Resampler {
+    UInt32      inRate;
+    UInt32      outRate;
+    int         halfTaps;               // taps either side of the interpolation point
+    int         numTaps;                // 2 * halfTaps, a multiple of 4
+    float *     coefs;                  // (kResamplePhases + 1) rows of numTaps coefficients
+} Resampler;
+
+typedef struct ConvertJob {
+    char *              inFileName;
+    char *              outFileName;
+    long                argIndex;
+    char *              result;         // the file's scan output, recorded in the checkpoint once converted
+    ExtCommonChunkPtr   commonChunkPtr; // private copy of the input COMM chunk
+    Boolean             isCompressed;
+    SampleFormat        format;
+    off_t               sampleDataOffset;
+    UInt32              inRate;
+    UInt32              outRate;
+} ConvertJob;
+
+typedef struct ResampleChannelArgs {
+    const Resampler *   resampler;
+    const float *       in;             // channel input, in[0] is input frame inBase
+    SInt64              inBase;
+    UInt64              firstOut;       // first output frame to produce
+    size_t              numOut;
+    float *             out;
+} ResampleChannelArgs;
+
+UInt32 convertRate;
+
+// Sharded and resumable scans (-S, -C and -M options)
+// Every file's output is gathered in resultBuffer so it can be recorded in a checkpoint file as well as printed.
+// A checkpoint file starts with checkpointMagic and a hash of the options that change the output (see
+// checkpointOptionsHash()) followed by one record per finished file: the file's position in the argument list,
+// the file name and its output, each NUL terminated. Records are only ever appended, so a record cut short by
+// a crash is simply ignored when the checkpoint is read back. Runs with different options can't be resumed
+// from or merged with each other's checkpoints.
+enum {
+    kCheckpointSyncInterval = 100       // fsync() the checkpoint file every this many records
+};
+const char checkpointMagic[] = "affix checkpoint 2";
+
+typedef struct CheckpointRecord {
+    long        argIndex;               // position of the file in the argument list, for putting shards back in order
+    char *      fileName;
+    char *      result;
+} CheckpointRecord;
+
+char * resultBuffer;
+size_t resultLength;
+size_t resultCapacity;
+
+unsigned int shardIndex;
+unsigned int shardCount;
+char * checkpointFileName;
+FILE * checkpointFile;
+unsigned int checkpointUnsynced;
+pthread_mutex_t checkpointMutex = PTHREAD_MUTEX_INITIALIZER;
+CheckpointRecord * checkpointTable;     // files finished by an earlier run, open addressed hash table on fileName
+size_t checkpointTableSize;
+size_t checkpointTableCount;
+pthread_t * convertThreads;             // file conversions run concurrently with parsing the next file
+int maxConvertThreads;
+int numConvertThreads;
+int activeConversions;                  // conversions running, channels only get their own threads while cores are free
+pthread_mutex_t convertMutex = PTHREAD_MUTEX_INITIALIZER;
+
 // AIFF/AIFF-C files always start with a FORM chunk
 // Following are the local chunks that may follow the FORM
 // * Can be one and one in a valid AIFF/AIFF-C file
@@ -80,6 +203,196 @@ unsigned int copyrightChunkCount;               // +
 // The only chunks in AIFF-C file not in AIFF file: formatVersionChunk
 // SAXL chunk was proposed as a part of AIFF-C but is not used/standardization was never finished?
 
+// Waveform peak files (-p option)
+// One pass over the sample data builds per channel min/max "pyramids" at several zoom levels. Each block of
+// kPeakBlockFrames frames finishes a whole number of bins at every level, so the bins are written out as
+// each block is done and memory use does not depend on file length. A peak file, all values big-endian:
+//   PeakFileHeader
+//   PeakLevelHeader for each level
+//   for each level, for each bin, for each channel: SInt16 min, SInt16 max (sample values scaled to 16 bits)
+enum {
+    kPeakFileID             = 'AFPK',
+    kPeakFileVersion        = 1,
+    kPeakLevels             = 3,
+    kPeakBlockFrames        = 65536     // must be a multiple of every peakFramesPerBin
+};
+const UInt32 peakFramesPerBin[kPeakLevels] = { 256, 1024, 4096 };       // each a multiple of the one before
+
+typedef struct PeakFileHeader {
+    UInt32      fileID;                 // kPeakFileID
+    UInt16      version;
+    UInt16      numChannels;
+    UInt32      numSampleFrames;
+    UInt32      numLevels;
+    UInt64      sampleRate;             // IEEE 64 bit float
+} PeakFileHeader;
+
+typedef struct PeakLevelHeader {
+    UInt32      framesPerBin;
+    UInt32      numBins;
+    UInt64      dataOffset;             // file offset of this level's bins
+} PeakLevelHeader;
+
+// Catalog of COMM fields (-k option) and the query subcommand
+// A scan with -k saves every file's COMM fields in a catalog file, one column (array) per field, which
+// "affix query" maps into memory and filters with a predicate such as 'rate != 48000 && channels == 2'.
+// The predicate is evaluated over kQueryChunkRows rows at a time: each comparison converts its column to double
+// and compares into a byte mask with simple loops that vectorize, then the masks are combined. A catalog file is
+// in native byte order:
+//   CatalogHeader
+//   one column array per CatalogColumn, each starting on an 8 byte boundary
+//   UInt64 per row, offset of the row's file name in the name heap
+//   name heap of NUL terminated file names
+enum {
+    kCatalogFileID          = 'AFCT',
+    kCatalogVersion         = 1,
+    kQueryChunkRows         = 4096,
+    kQueryMaxNodes          = 256
+};
+
+typedef enum CatalogColumn {
+    kColumnNumChannels,                 // UInt16
+    kColumnNumSampleFrames,             // UInt32
+    kColumnSampleSize,                  // UInt16
+    kColumnSampleRate,                  // double
+    kColumnFormType,                    // UInt32 four character code, 'AIFF' or 'AIFC'
+    kColumnCompressionType,             // UInt32 four character code, 'NONE' for AIFF
+    kCatalogColumns
+} CatalogColumn;
+
+const char * catalogColumnNames[kCatalogColumns] = { "channels", "frames", "bits", "rate", "form", "compression" };
+const size_t catalogColumnWidths[kCatalogColumns] = { sizeof(UInt16), sizeof(UInt32), sizeof(UInt16), sizeof(double), sizeof(UInt32), sizeof(UInt32) };
+
+typedef struct CatalogHeader {
+    UInt32      fileID;                 // kCatalogFileID
+    UInt32      version;
+    UInt64      numRows;
+    UInt64      columnOffsets[kCatalogColumns];
+    UInt64      nameOffsetsOffset;
+    UInt64      nameHeapOffset;
+    UInt64      nameHeapSize;
+} CatalogHeader;
+
+typedef enum QueryNodeType { kQueryCompare, kQueryAnd, kQueryOr, kQueryNot } QueryNodeType;
+typedef enum QueryOperator { kQueryEQ, kQueryNE, kQueryLT, kQueryLE, kQueryGT, kQueryGE } QueryOperator;
+
+typedef struct QueryNode {
+    QueryNodeType   type;
+    CatalogColumn   column;             // kQueryCompare
+    QueryOperator   op;                 // kQueryCompare
+    double          value;              // kQueryCompare
+    int             left;               // kQueryAnd, kQueryOr and kQueryNot operand
+    int             right;              // kQueryAnd and kQueryOr operand
+} QueryNode;
+
+char * catalogFileName;                 // -k, catalog to write
+void * catalogData[kCatalogColumns];    // columns being built, or mapped from a catalog file
+UInt64 * catalogNameOffsets;
+char * catalogNameHeap;
+size_t catalogNameHeapSize;
+size_t catalogNameHeapCapacity;
+size_t catalogRows;
+size_t catalogCapacity;
+
+const char * queryText;
+const char * queryPosition;
+QueryNode queryNodes[kQueryMaxNodes];
+int numQueryNodes;
+
+// Metadata editing (tag subcommand)
+// NAME, AUTH, (c) , COMT and ANNO chunks are replaced in the space of the chunks they replace plus any affix padding
+// chunks (APPL chunks with signature kPaddingSignature), so files tagged once can be retagged by rewriting a few
+// kilobytes. When the new text does not fit it is appended at the end of the FORM with kTagPaddingReserve bytes of
+// padding after it for next time, and the old chunks become padding. Only if neither works, e.g. there is data
+// after the FORM, is the whole file copied with copyBytes().
+enum {
+    kPaddingSignature       = 'afpd',
+    kTagPaddingReserve      = 4096,
+    kMinPaddingChunkSize    = sizeof(ChunkHeader) + sizeof(OSType),     // an APPL chunk with just its signature
+    kCopyBufferSize         = 1048576,
+    kMaxTagEdits            = 5
+};
+
+typedef struct TagEdit {
+    UInt32      ckID;                   // host byte order
+    const char *text;                   // "" removes the chunk
+} TagEdit;
+
+typedef struct TagSlot {
+    off_t       offset;                 // file offset of a run of chunks that can be overwritten
+    off_t       size;
+    off_t       used;                   // bytes of new chunks placed at the start of the run
+} TagSlot;
+
+typedef struct TagChunk {
+    UInt8 *     bytes;                  // complete chunk, header, text and pad byte
+    size_t      size;
+    int         slot;                   // where it was placed, -1 if not placed yet
+    off_t       offset;                 // offset within the slot
+} TagChunk;
+
+// Sample data splicing (split, trim and concat subcommands)
+// split and trim clone the input with clonefile() where the volume supports it (APFS) and then rewrite the COMM frame
+// count, the SSND offset and sizes and the FORM size in place and cut off the tail, so no sample data is copied. The
+// frames before the first one are left in place as SSND offset bytes and other chunks become padding chunks.
+// Otherwise, and always for concat, output files get fresh FORM, FVER, COMM and SSND headers from writeAIFFHeader()
+// and their sample data is copied from the inputs with copyBytes(), whole frames at a time, without decoding.
+enum {
+    kMaxSpliceSegments      = 4096
+};
+
+typedef struct SpliceSource {
+    const char *        fileName;
+    int                 fd;
+    ExtCommonChunkPtr   commonChunkPtr;         // private copy of the COMM chunk
+    Boolean             isCompressed;
+    SampleFormat        format;                 // bytesPerSample is bytes per frame / numChannels for ulaw and alaw
+    off_t               sampleDataOffset;
+} SpliceSource;
+
+typedef struct SpliceSegment {
+    const SpliceSource *source;
+    UInt32              firstFrame;
+    UInt32              numFrames;
+} SpliceSegment;
+
+// I/O budget (-I, -B, -L and -P options)
+// All file reads and writes go through throttleIO(), which takes tokens from an I/O operations per second bucket
+// and a bytes per second bucket. A caller that runs a bucket into debt sleeps until the debt would have been paid
+// off, so concurrent callers queue up fairly. With -L the bucket rates are scaled back while the average read
+// latency is over the target, and recover while it is under (multiplicative decrease, additive increase).
+// stat(), access() and open() each cost a metadata lookup and are charged as an operation of no bytes.
+// lseek() only moves the file offset, it costs no I/O and is not charged.
+enum {
+    kHeaderCacheSize        = 65536     // read ahead for the chunk walk when there is an IOPS budget
+};
+const double ioBurstSeconds         = 0.25;     // bucket depth, in seconds worth of tokens
+const double ioAdjustSeconds        = 0.1;      // how often the rate scale can change
+const double ioMinRateScale         = 0.02;
+const double ioLatencySampleBytes   = 65536.0;  // latency of bigger reads is scaled down to this size
+
+typedef struct TokenBucket {
+    double      rate;                   // tokens per second at full rate, 0 for unlimited
+    double      burst;                  // most tokens that can be saved up
+    double      tokens;                 // goes negative when a caller takes more than there is
+} TokenBucket;
+
+TokenBucket iopsBucket;
+TokenBucket bytesBucket;
+double ioLastRefill;
+double ioRateScale = 1.0;               // adaptive backoff, 1.0 is the full configured rate
+double ioLatencyTarget;                 // seconds, 0 for no adaptive backoff
+double ioLatencyAverage;
+double ioLastAdjust;
+pthread_mutex_t ioMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// With an IOPS budget the chunk walk reads kHeaderCacheSize at a time and serves its small header reads
+// from that, so walking a file typically costs one or two I/Os rather than one per chunk. Main thread only.
+UInt8 * headerCache;
+int headerCacheFd = -1;
+off_t headerCacheOffset;
+size_t headerCacheLength;
+
 // Function declarations
 UInt32  getFORMChunk(int fd, ChunkHeaderPtr chunkPtr);
 UInt32  getChunks(int fd, ChunkHeaderPtr chunkPtr);
@@ -88,6 +401,78 @@ UInt32  getChunkBody(int fd, ChunkHeaderPtr chunkPtr, size_t size);
 size_t  padOddSize(size_t size);
 char *  stringFromUInt32(UInt32 val);
 char *  cASCIIStringCopyFromCFString(CFStringRef cfString);
+Boolean getSampleFormat(ExtCommonChunkPtr extCommPtr, Boolean isCompressed, SampleFormat * format);
+void    decodeSamples(const UInt8 * src, size_t numFrames, const SampleFormat * format, float ** channels, size_t channelOffset);
+void    encodeSamples(float ** channels, size_t numFrames, const SampleFormat * format, UInt8 * dst);
+ssize_t writeAIFFHeader(int fd, ExtCommonChunkPtr extCommPtr, Boolean isCompressed, const SampleFormat * format,
+                        UInt32 numSampleFrames, long double sampleRate, UInt32 ssndOffset, UInt32 ssndBlockSize);
+double  besselI0(double x);
+Boolean initResampler(Resampler * resampler, UInt32 inRate, UInt32 outRate);
+void *  resampleChannel(void * args);
+void *  convertFile(void * job);
+Boolean queueConvertJob(const char * inFileName, long double inRate, long argIndex, const char * result);
+void    finishConvertJobs(void);
+char *  numberedFileName(const char * inFileName, UInt32 number);
+double  monotonicSeconds(void);
+double  takeTokens(TokenBucket * bucket, double count, double elapsed);
+void    throttleIO(size_t bytes);
+void    observeIOLatency(double seconds, size_t bytes);
+ssize_t throttledRead(int fd, void * buf, size_t size);
+ssize_t throttledPread(int fd, void * buf, size_t size, off_t offset);
+ssize_t throttledWrite(int fd, const void * buf, size_t size);
+ssize_t throttledPwrite(int fd, const void * buf, size_t size, off_t offset);
+int     throttledStat(const char * path, struct stat * sb);
+int     throttledAccess(const char * path, int mode);
+int     throttledOpen(const char * path, int flags, mode_t mode);
+ssize_t cachedPread(int fd, void * buf, size_t size, off_t offset);
+void    forgetHeaderCache(void);
+void    initTokenBucket(TokenBucket * bucket, double rate);
+Boolean setIOPolicy(const char * policyName);
+void    minMaxSamples(const float * samples, size_t numSamples, float * minSample, float * maxSample);
+SInt16  peakValue(float sample);
+Boolean writePeakFile(int fd, const char * inFileName);
+void    resetChunkWalk(void);
+Boolean readChunkTable(int fd);
+void    addChunkTableEntry(UInt32 ckID, off_t offset, UInt32 ckSize);
+Boolean soundDataBytesPerFrame(UInt32 * bytesPerFrame);
+void    verifyFile(int fd, const char * inFileName);
+ssize_t copyBytes(int inFd, off_t inOffset, int outFd, off_t outOffset, size_t size);
+Boolean isPaddingChunk(int fd, const ChunkTableEntry * chunk);
+TagChunk makeTextChunk(UInt32 ckID, const char * text);
+Boolean placeTagChunks(TagSlot * slots, int numSlots, TagChunk * chunks, int numChunks);
+Boolean writeTagSlot(int fd, const TagSlot * slot, int slotIndex, const TagChunk * chunks, int numChunks);
+Boolean rewriteTaggedFile(int fd, const char * inFileName, const struct stat * sb, const Boolean * isFree, TagChunk * chunks, int numChunks);
+int     tagFile(const char * inFileName, const TagEdit * edits, int numEdits);
+int     tagCommand(int argc, const char * argv[]);
+Boolean openSpliceSource(const char * inFileName, SpliceSource * source);
+void    closeSpliceSource(SpliceSource * source);
+Boolean parseFramePosition(const char * string, const SpliceSource * source, UInt32 * frame);
+Boolean cloneSpliceFile(const char * outFileName, const SpliceSegment * segment);
+Boolean writeSpliceFile(const char * outFileName, const SpliceSegment * segments, int numSegments, Boolean tryClone);
+int     spliceCommand(int argc, const char * argv[]);
+void    addCatalogRow(const char * rowFileName);
+void    writeCatalogFile(const char * catalogName);
+void    mapCatalogFile(const char * catalogName);
+int     newQueryNode(QueryNodeType type);
+void    skipQuerySpace(void);
+void    queryError(const char * message);
+int     parseQueryOr(void);
+int     parseQueryAnd(void);
+int     parseQueryUnary(void);
+int     parseQueryComparison(void);
+void    evaluateQuery(int node, size_t firstRow, size_t numRows, UInt8 ** masks, double * scratch);
+int     queryCommand(int argc, const char * argv[]);
+UInt32  hashString(const char * string);
+void    resultPrintf(const char * format, ...);
+UInt32  checkpointOptionsHash(unsigned int resetRate);
+long    readCheckpointFile(const char * checkpointName, CheckpointRecord ** records, UInt32 * optionsHash, off_t * completeLength);
+void    openCheckpointFile(const char * checkpointName, UInt32 optionsHash);
+void    addCompletedFile(long argIndex, char * completedFileName, char * result);
+const char * completedFileResult(const char * completedFileName);
+void    recordCheckpoint(long argIndex, const char * completedFileName, const char * result);
+void    closeCheckpointFile(void);
+int     compareCheckpointRecords(const void * a, const void * b);
+void    mergeCheckpointFiles(int numFiles, const char * checkpointNames[]);
 void    usage(const char * ourNameString);
 void    printVersion(const char * ourNameString);
 
@@ -108,6 +493,19 @@ int main(int argc, const char * argv[]) {
         exit(-1);
     }
     
+    savedCommonChunkPtr   = calloc(1, maxChunkSize);
+    if (savedCommonChunkPtr == 0) {
+        fprintf(stderr, "calloc(1, maxChunkSize = %lu) failed\n", maxChunkSize);
+        exit(-1);
+    }
+    
+    resultCapacity        = 4096;
+    resultBuffer          = calloc(1, resultCapacity);
+    if (resultBuffer == 0) {
+        fprintf(stderr, "calloc(1, resultCapacity = %lu) failed\n", resultCapacity);
+        exit(-1);
+    }
+    
     // All these chunk pointers point to the same memory
     // If we were going to do anything with them we'd keep them separate but here we
     // just recycle the same memory as we mostly care about the commonChunk and sample rate in it
@@ -117,9 +515,25 @@ int main(int argc, const char * argv[]) {
     extCommonChunkPtr     = (ExtCommonChunkPtr) chunkHeaderPtr;
     formatVersionChunkPtr = (FormatVersionChunkPtr) chunkHeaderPtr;
     
+    programName = basename((char *) argv[0]);
+    
+    // Subcommands take their own options.
+    
+    if (argc > 1 && strcmp(argv[1], "query") == 0) {
+        exit(queryCommand(argc - 1, argv + 1));
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "tag") == 0) {
+        exit(tagCommand(argc - 1, argv + 1));
+    }
+    
+    if (argc > 1 && (strcmp(argv[1], "split") == 0 || strcmp(argv[1], "trim") == 0 || strcmp(argv[1], "concat") == 0)) {
+        exit(spliceCommand(argc - 1, argv + 1));
+    }
+    
     int c;
     
-    while ((c = getopt(argc, (char * const *) argv, "dfs:ntvVh")) != -1) {
+    while ((c = getopt(argc, (char * const *) argv, "dfs:c:S:C:MI:B:L:P:pk:xntvVh")) != -1) {
         
         switch (c) {
                 
@@ -152,6 +566,94 @@ int main(int argc, const char * argv[]) {
                 
                 break;
                 
+            case 'c':
+                convertOpt = TRUE;
+                int convertChars;
+                
+                if (sscanf(optarg, "%u%n", &convertRate, &convertChars) != 1 || convertChars < strlen(optarg) || convertRate == 0) {
+                    fprintf(stderr, "-c sampleRate option must be a positive integer value\n");
+                    exit(-1);
+                }
+                break;
+                
+            case 'S':
+                shardOpt = TRUE;
+                int shardChars;
+                
+                if (sscanf(optarg, "%u/%u%n", &shardIndex, &shardCount, &shardChars) != 2 || shardChars < strlen(optarg) ||
+                    shardCount == 0 || shardIndex >= shardCount) {
+                    fprintf(stderr, "-S shard option must be i/N with 0 <= i < N, e.g. -S 0/4\n");
+                    exit(-1);
+                }
+                break;
+                
+            case 'C':
+                checkpointFileName = optarg;
+                break;
+                
+            case 'M':
+                mergeOpt = TRUE;
+                break;
+                
+            case 'I':
+                ioBudgetOpt = TRUE;
+                
+                if (sscanf(optarg, "%lf", &iopsBucket.rate) != 1 || iopsBucket.rate <= 0.0) {
+                    fprintf(stderr, "-I iops option must be a positive number of I/O operations per second\n");
+                    exit(-1);
+                }
+                break;
+                
+            case 'B':
+                ioBudgetOpt = TRUE;
+                char unit = '\0';
+                
+                // Bytes per second with an optional k, m or g (binary) multiplier.
+                
+                if (sscanf(optarg, "%lf%c", &bytesBucket.rate, &unit) < 1 || bytesBucket.rate <= 0.0 ||
+                    (unit != '\0' && strchr("kKmMgG", unit) == NULL)) {
+                    fprintf(stderr, "-B bytesPerSecond option must be a positive number, optionally followed by k, m or g\n");
+                    exit(-1);
+                }
+                
+                if (unit == 'k' || unit == 'K') {
+                    bytesBucket.rate *= 1024.0;
+                }
+                else if (unit == 'm' || unit == 'M') {
+                    bytesBucket.rate *= 1024.0 * 1024.0;
+                }
+                else if (unit == 'g' || unit == 'G') {
+                    bytesBucket.rate *= 1024.0 * 1024.0 * 1024.0;
+                }
+                break;
+                
+            case 'L':
+                if (sscanf(optarg, "%lf", &ioLatencyTarget) != 1 || ioLatencyTarget <= 0.0) {
+                    fprintf(stderr, "-L latency option must be a positive number of milliseconds\n");
+                    exit(-1);
+                }
+                ioLatencyTarget /= 1000.0;
+                break;
+                
+            case 'P':
+                if (!setIOPolicy(optarg)) {
+                    fprintf(stderr, "-P priority option must be one of important, standard, utility, throttle or passive\n");
+                    exit(-1);
+                }
+                break;
+                
+            case 'p':
+                peaksOpt = TRUE;
+                break;
+                
+            case 'k':
+                catalogFileName = optarg;
+                break;
+                
+            case 'x':
+                verifyOpt = TRUE;
+                break;
+                
             case 'n':
                 noWriteOpt = TRUE;
                 break;
@@ -180,6 +682,13 @@ int main(int argc, const char * argv[]) {
     if (debugOpt) {
         fprintf(stderr, "DEBUG: debugOpt        = %s\n", debugOpt       ? "TRUE" : "FALSE");
         fprintf(stderr, "DEBUG: sampleRateOpt   = %s\n", sampleRateOpt  ? "TRUE" : "FALSE");
+        fprintf(stderr, "DEBUG: convertOpt      = %s\n", convertOpt     ? "TRUE" : "FALSE");
+        fprintf(stderr, "DEBUG: shardOpt        = %s (%u/%u)\n", shardOpt ? "TRUE" : "FALSE", shardIndex, shardCount);
+        fprintf(stderr, "DEBUG: checkpoint file = %s\n", checkpointFileName ? checkpointFileName : "(none)");
+        fprintf(stderr, "DEBUG: mergeOpt        = %s\n", mergeOpt       ? "TRUE" : "FALSE");
+        fprintf(stderr, "DEBUG: peaksOpt        = %s\n", peaksOpt       ? "TRUE" : "FALSE");
+        fprintf(stderr, "DEBUG: verifyOpt       = %s\n", verifyOpt      ? "TRUE" : "FALSE");
+        fprintf(stderr, "DEBUG: catalog file    = %s\n", catalogFileName ? catalogFileName : "(none)");
         fprintf(stderr, "DEBUG: verboseOpt      = %s\n", verboseOpt     ? "TRUE" : "FALSE");
     }
     
@@ -192,84 +701,153 @@ int main(int argc, const char * argv[]) {
     CFTimeZoneSetDefault(utcTz);
     CFRelease(utcTz);
     
+    if (sampleRateOpt && convertOpt) {
+        fprintf(stderr, "-s and -c options can not be used together\n");
+        exit(-1);
+    }
+    
+    // A catalog only has rows for the files parsed in this run, files skipped as another shard's or as
+    // already done by a checkpointed run would silently be missing from it.
+    
+    if (catalogFileName != NULL && (shardOpt || checkpointFileName != NULL)) {
+        fprintf(stderr, "-k option can not be used with -S or -C, a catalog must be built by a single complete scan\n");
+        exit(-1);
+    }
+    
+    if (convertOpt) {
+        maxConvertThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        if (maxConvertThreads < 1) {
+            maxConvertThreads = 1;
+        }
+        convertThreads = calloc(maxConvertThreads, sizeof(pthread_t));
+    }
+    
     if (argc == optind) {
         fprintf(stderr, "no file specified. Type %s -h for help\n", basename((char *) argv[0]));
         exit(-1);
     }
     
+    if (ioLatencyTarget > 0.0 && !ioBudgetOpt) {
+        fprintf(stderr, "-L latency option needs an -I or -B budget to scale back\n");
+        exit(-1);
+    }
+    
+    if (ioBudgetOpt) {
+        initTokenBucket(&iopsBucket, iopsBucket.rate);
+        initTokenBucket(&bytesBucket, bytesBucket.rate);
+        ioLastRefill = monotonicSeconds();
+        ioLastAdjust = ioLastRefill;
+        
+        if (iopsBucket.rate > 0.0) {
+            headerCache = malloc(kHeaderCacheSize);
+        }
+        
+        if (debugOpt) {
+            fprintf(stderr, "DEBUG: I/O budget %.0f IOPS, %.0f bytes/s, latency target %.1f ms\n",
+                    iopsBucket.rate, bytesBucket.rate, ioLatencyTarget * 1000.0);
+        }
+    }
+    
+    if (mergeOpt) {
+        // The file arguments are checkpoint files from -C runs, print their combined results.
+        mergeCheckpointFiles(argc - optind, argv + optind);
+        exit(0);
+    }
+    
+    if (checkpointFileName != NULL) {
+        openCheckpointFile(checkpointFileName, checkpointOptionsHash(sampleRateOpt ? inputSampleRate : 0));
+    }
+    
     for (int i = optind; i < argc ; i++) {
         // Loop over filenames in argv
         
-        // We keep count of chunks where there can only be one of that type in the file.
-        commChunkCount              = 0;
-        formatVersionChunkCount     = 0;
-        soundDataChunkCount         = 0;
-        markerChunkCount            = 0;
-        instrumentChunkCount        = 0;
-        midiDataChunkCount          = 0;
-        audioRecordingChunkCount    = 0;
-        commentChunkCount           = 0;
-        nameChunkCount              = 0;
-        authorChunkCount            = 0;
-        copyrightChunkCount         = 0;
+        resetChunkWalk();
+        resultLength                = 0;
+        resultBuffer[0]             = '\0';
         
         fileName = (char *) argv[i];
         
+        if (shardOpt && hashString(fileName) % shardCount != shardIndex) {
+            continue;       // another shard's file
+        }
+        
         if (debugOpt) {
             fprintf(stderr, "DEBUG: processing file: %s\n", fileName);
         }
         
-        if (stat(fileName, &sb) == -1) {
+        const char * completedResult;
+        
+        if (checkpointFile != NULL && (completedResult = completedFileResult(fileName)) != NULL) {
+            // Finished by an earlier run, just repeat its output.
+            fputs(completedResult, stdout);
+            continue;
+        }
+        
+        if (throttledStat(fileName, &sb) == -1) {
             if (errno == ENOENT) {
                 fprintf(stderr, "ERROR: %s does not exist\n", fileName);
-                break;
+                continue;
             }
         }
         
-        if ((stat(fileName, &sb) == 0 && S_ISDIR(sb.st_mode))) {
+        if ((throttledStat(fileName, &sb) == 0 && S_ISDIR(sb.st_mode))) {
             fprintf(stderr, "%s is directory, skipping\n", fileName);
-            break;
+            continue;
         }
         
-        if (!(stat(fileName, &sb) == 0 && S_ISREG(sb.st_mode))) {
+        if (!(throttledStat(fileName, &sb) == 0 && S_ISREG(sb.st_mode))) {
             fprintf(stderr, "ERROR: %s is not a standard file, skipping\n", fileName);
-            break;
+            continue;
         }
         
         if (sampleRateOpt) {
             // Need file writable as well as readable
             // Be a little anal-retentive about explaining permission problems for non-technical users
-            if ((access(fileName, R_OK) == -1) && (access(fileName, W_OK) == 0)) {
+            if ((throttledAccess(fileName, R_OK) == -1) && (throttledAccess(fileName, W_OK) == 0)) {
                 fprintf(stderr, "ERROR: %s is not readable, skipping file\n", fileName);
-                break;
+                continue;
             }
-            else if ((access(fileName, R_OK) == 0) && (access(fileName, W_OK) == -1)) {
+            else if ((throttledAccess(fileName, R_OK) == 0) && (throttledAccess(fileName, W_OK) == -1)) {
                 fprintf(stderr, "ERROR: %s is not writable, skipping file\n", fileName);
-                break;
+                continue;
             }
-            else if ((access(fileName, R_OK) == -1) && (access(fileName, W_OK) == -1)) {
+            else if ((throttledAccess(fileName, R_OK) == -1) && (throttledAccess(fileName, W_OK) == -1)) {
                 fprintf(stderr, "ERROR: %s is not readable and not writable, skipping file\n", fileName);
-                break;
+                continue;
             }
             else {
                 // open file for reading and writing
-                if ((fd = open(fileName, O_RDWR)) == -1) {
+                if ((fd = throttledOpen(fileName, O_RDWR, 0)) == -1) {
                     fprintf(stderr, "ERROR: %s not readable and writable, skipping file\n", fileName);
-                    break;
+                    continue;
                 }
             }
         }
         else {
             // not rateOpt -- only need readable
-            if ((fd = open(fileName, O_RDONLY)) == -1) {
+            if ((fd = throttledOpen(fileName, O_RDONLY, 0)) == -1) {
                 fprintf(stderr, "ERROR: %s: %s, not readable, skipping file\n", fileName, strerror(errno));
-                break;
+                continue;
             }
         }
 
         getFORMChunk(fd, chunkHeaderPtr);
         
         if (invalidFile) {
+            
+            if (verifyOpt) {
+                if (fstat(fd, &sb) == 0 && sb.st_size < sizeof(ContainerChunk)) {
+                    resultPrintf("%s\tverify\ttruncated: file is %lld bytes, too short for a \'FORM\' chunk\n", fileName, (long long) sb.st_size);
+                }
+                else {
+                    resultPrintf("%s\tverify\tnot an AIFF/AIFF-C file\n", fileName);
+                }
+                fwrite(resultBuffer, 1, resultLength, stdout);
+            }
+            
+            close(fd);
+            forgetHeaderCache();
+            recordCheckpoint(i - optind, fileName, resultBuffer);
             continue;
         }
         
@@ -319,7 +897,7 @@ int main(int argc, const char * argv[]) {
                     
                     // For testing we read not write
                     
-                    if ((r = read(fd, &testRate, sizeof(extended80))) == -1) {
+                    if ((r = throttledRead(fd, &testRate, sizeof(extended80))) == -1) {
                         fprintf(stderr, "%s read(fd=%d, &test=0x%lx, sizeof(extended80)=%ld) = %zd\n", fileName, fd, (unsigned long) &testRate, sizeof(extended80), r);
                     }
                     x80told(&extCommonChunkPtr->sampleRate, &testRateLD);
@@ -335,9 +913,14 @@ int main(int argc, const char * argv[]) {
                     extended80 x80;
                     ldtox80(&sampleRate, &x80);
                     
-                    if ((r = write(fd, &x80, sizeof(extended80))) == -1) {
+                    forgetHeaderCache();
+                    
+                    if ((r = throttledWrite(fd, &x80, sizeof(extended80))) == -1) {
                         fprintf(stderr, "%s write(fd=%d, &test=0x%lx, sizeof(extended80)=%ld) = %zd\n", fileName, fd, (unsigned long) &testRate, sizeof(extended80), r);
                     }
+                    else {
+                        savedCommonChunkPtr->sampleRate = x80;      // -k and -p record the rate now on disk
+                    }
                 }
                 
                 size_t ret;
@@ -358,7 +941,7 @@ int main(int argc, const char * argv[]) {
                     CFRelease(cfCompressionName);
                     
                     if (verboseOpt) {
-                        printf("%s\t%d\t%u\t%d\t%.0Lf\t%s\t%s",
+                        resultPrintf("%s\t%d\t%u\t%d\t%.0Lf\t%s\t%s",
                                 fileName,
                                 CFSwapInt16(extCommonChunkPtr->numChannels),
                                 CFSwapInt32(extCommonChunkPtr->numSampleFrames),
@@ -368,7 +951,7 @@ int main(int argc, const char * argv[]) {
                                 compressionName);
                     }
                     else {
-                        printf("%s\t%.0Lf",
+                        resultPrintf("%s\t%.0Lf",
                                 fileName,
                                 oldRateLD);
                     }
@@ -385,11 +968,11 @@ int main(int argc, const char * argv[]) {
                     long double fractional = modfl(oldRateLD, &integral);
                     
                     if (fractional != 0) {
-                        printf("%s: file has fractional sample rate, integer value shown is only approximate\n", fileName);
+                        resultPrintf("%s: file has fractional sample rate, integer value shown is only approximate\n", fileName);
                     }
                 
                     if (verboseOpt) {
-                        printf("%s\t%d\t%u\t%d\t\%.0Lf\t\%s\t\%s",
+                        resultPrintf("%s\t%d\t%u\t%d\t\%.0Lf\t\%s\t\%s",
                                 fileName,
                                 CFSwapInt16(commonChunkPtr->numChannels),
                                 CFSwapInt32(commonChunkPtr->numSampleFrames),
@@ -400,20 +983,59 @@ int main(int argc, const char * argv[]) {
         
                     }
                     else {
-                        printf("%s\t%.0Lf",
+                        resultPrintf("%s\t%.0Lf",
                                 fileName,
                                 oldRateLD);
                     }
                 }
                 
                 if (sampleRateOpt) {
-                    printf("\tsample rate reset to: %.0Lf", sampleRate);
+                    resultPrintf("\tsample rate reset to: %.0Lf", sampleRate);
                 }
-                printf("\n");
+                resultPrintf("\n");
             }
         }
+        
+        if (verifyOpt) {
+            verifyFile(fd, fileName);
+        }
+        
+        if (peaksOpt && !invalidFile && commChunkCount == 1) {
+            writePeakFile(fd, fileName);
+        }
+        
+        if (catalogFileName != NULL && !invalidFile && commChunkCount == 1) {
+            addCatalogRow(fileName);
+        }
+        
+        close(fd);
+        forgetHeaderCache();
+        
+        fwrite(resultBuffer, 1, resultLength, stdout);
+        
+        // A file handed off for conversion is recorded in the checkpoint once its conversion is finished.
+        
+        Boolean queued = FALSE;
+        
+        if (convertOpt && !invalidFile && commChunkCount == 1) {
+            x80told(&savedCommonChunkPtr->sampleRate, &oldRateLD);
+            queued = queueConvertJob(fileName, oldRateLD, i - optind, resultBuffer);
+        }
+        
+        if (!queued) {
+            recordCheckpoint(i - optind, fileName, resultBuffer);
+        }
+        
         foundEOF=FALSE;
     }
+    
+    finishConvertJobs();
+    closeCheckpointFile();
+    
+    if (catalogFileName != NULL) {
+        writeCatalogFile(catalogFileName);
+    }
+    
     exit(0);
 }
 
@@ -425,9 +1047,20 @@ UInt32 getChunkHead(int fd, ChunkHeaderPtr chunkPtr)  {
     memset(chunkPtr, 0, sizeof(maxChunkSize));                              // null out the chunk buffer we read into, makes debugging easier.
     // A more thorough program would read all these into separate chunk memory structures, at least for the small chunks.
     
-    if ((ret = read(fd, chunkPtr,  sizeof(ChunkHeader))) != sizeof(ChunkHeader)) {
+    if ((ret = throttledRead(fd, chunkPtr,  sizeof(ChunkHeader))) != sizeof(ChunkHeader)) {
+        
+        if (ret > 0) {
+            
+            // A file cut off part way through a chunk header, e.g. by an interrupted copy.
+            
+            fprintf(stderr, "%s: invalid AIFF/AIFF-C file, truncated chunk header at end of file\n", fileName);
+            invalidFile = TRUE;
+            foundEOF = TRUE;
+            
+            return 0;
+        }
         
-        if (ret != 0) {
+        else if (ret != 0) {
             fprintf(stderr, "ERROR: %s: %s: read(fd=%d, chunkPtr=0x%lx, sizeof(ChunkHeader)=%lu)) != sizeof(ChunkHeader) returned %zd bytes\n",
                     fileName, strerror(errno), fd, (unsigned long) chunkPtr, sizeof(ChunkHeader), ret);
             exit(-1);
@@ -464,7 +1097,17 @@ UInt32 getChunkBody(int fd, ChunkHeaderPtr chunkPtr, size_t size)  {
 
     ssize_t ret;
     
-    if ((ret = read(fd, (char *) chunkPtr + sizeof(ChunkHeader), size)) != size) {
+    if ((ret = throttledRead(fd, (char *) chunkPtr + sizeof(ChunkHeader), size)) != size && ret >= 0) {
+        
+        // File cut off part way through the chunk.
+        
+        fprintf(stderr, "%s: invalid AIFF/AIFF-C file, \'%s\' chunk is truncated, skipping file\n", fileName, stringFromUInt32(chunkPtr->ckID));
+        invalidFile = TRUE;
+        foundEOF = TRUE;
+        
+        return 0;
+    }
+    else if (ret != size) {
         perror("ERROR: read(fd, (containerChunkPtr + sizeof(ChunkHeader)), size)) != size)");
         fprintf(stderr, "ERROR: read() returned %zd bytes, expected %lu bytes\n", ret, size);
         exit(-1);
@@ -484,19 +1127,36 @@ UInt32 getFORMChunk(int fd, ChunkHeaderPtr chunkPtr)  {
     
     containerChunkPtr = (ContainerChunkPtr) chunkPtr;
                                                    
-    if ((ret = read(fd, containerChunkPtr,  sizeof(ChunkHeader))) != sizeof(ChunkHeader)) {
+    if ((ret = throttledRead(fd, containerChunkPtr,  sizeof(ChunkHeader))) != sizeof(ChunkHeader) && ret >= 0) {
+        
+        // Empty or nearly empty files are what an aborted copy usually leaves behind.
+        
+        fprintf(stderr, "%s: invalid AIFF/AIFF-C file: file is truncated, only %zd bytes, skipping\n", fileName, ret);
+        invalidFile = TRUE;
+        
+        return 0;
+    }
+    else if (ret != sizeof(ChunkHeader)) {
         perror("ERROR: read(fd, chunkPtr, sizeof(ChunkHeader))) != sizeof(ChunkHeader)");
         fprintf(stderr, "ERROR: %s: read() returned %zd bytes, expected %lu bytes\n", fileName, ret, sizeof(ChunkHeader));
         exit(-1);
     }
     
     if (CFSwapInt32(containerChunkPtr->ckID) == FORMID) {
-        if ((ret = read(fd, &containerChunkPtr->formType, sizeof(containerChunkPtr->formType) ) ) != sizeof(containerChunkPtr->formType)) {
+        if ((ret = throttledRead(fd, &containerChunkPtr->formType, sizeof(containerChunkPtr->formType) ) ) != sizeof(containerChunkPtr->formType) && ret >= 0) {
+            fprintf(stderr, "%s: invalid AIFF/AIFF-C file: file is truncated, only %zd bytes, skipping\n", fileName, sizeof(ChunkHeader) + ret);
+            invalidFile = TRUE;
+            
+            return 0;
+        }
+        else if (ret != sizeof(containerChunkPtr->formType)) {
             perror("ERROR: read(fd, &containerChunkPtr->formType, sizeof(containerChunkPtr->formType))) != sizeof(containerChunkPtr->formType)");
             fprintf(stderr, "ERROR: %s: read() returned %zd bytes, expected %lu bytes\n", fileName, ret, sizeof(containerChunkPtr->formType));
             exit(-1);
         }
         
+        formChunkSize = CFSwapInt32(containerChunkPtr->ckSize);
+        
         if (CFSwapInt32(containerChunkPtr->formType) == AIFFID) {
             aiffIsCompressed = FALSE;
         }
@@ -527,6 +1187,8 @@ UInt32 getChunks(int fd, ChunkHeaderPtr chunkPtr)  {
         return 0;
     }
     
+    addChunkTableEntry(CFSwapInt32(id), lseek(fd, 0, SEEK_CUR) - sizeof(ChunkHeader), CFSwapInt32(chunkPtr->ckSize));
+    
     switch (CFSwapInt32(id)) {
             
         case FORMID:
@@ -549,6 +1211,7 @@ UInt32 getChunks(int fd, ChunkHeaderPtr chunkPtr)  {
             
             id = getChunkBody(fd, chunkPtr,  padOddSize(CFSwapInt32(chunkPtr->ckSize)));
             extCommonChunkPtr = (ExtCommonChunk *) chunkPtr;
+            memcpy(savedCommonChunkPtr, chunkPtr, maxChunkSize);
             return id;
             break;
             
@@ -604,6 +1267,15 @@ UInt32 getChunks(int fd, ChunkHeaderPtr chunkPtr)  {
                 fprintf(stderr, "%s: invalid AIFF/AIFF-C file, contains more than one \'SSND\' sound data chunk, skipping file\n", fileName);
                 invalidFile = TRUE;
             }
+            
+            // Remember where the sample data is, modes that process the audio come back for it after the chunk walk.
+            
+            soundDataChunkOffset = lseek(fd, 0, SEEK_CUR) - sizeof(ChunkHeader);
+            
+            if (cachedPread(fd, &savedSoundDataChunk, sizeof(SoundDataChunk), soundDataChunkOffset) != sizeof(SoundDataChunk)) {
+                fprintf(stderr, "%s: invalid AIFF/AIFF-C file, \'SSND\' sound data chunk is truncated\n", fileName);
+                soundDataChunkOffset = 0;
+            }
             goto skipChunk;
 
         case MarkerID:
@@ -697,9 +1369,10 @@ UInt32 getChunks(int fd, ChunkHeaderPtr chunkPtr)  {
             
         default:
             
+            // Skip over it like the chunks we don't care about, so the chunks after it are still found.
+            
             fprintf(stderr, "%s: unknown chunk type: %s\n", fileName, stringFromUInt32(chunkHeaderPtr->ckID));
-            return 0;
-            break;
+            goto skipChunk;
             
     }
 }
@@ -738,9 +1411,3457 @@ char * cASCIIStringCopyFromCFString(CFStringRef cfString) {
 }
 
 
+Boolean getSampleFormat(ExtCommonChunkPtr extCommPtr, Boolean isCompressed, SampleFormat * format) {
+    
+    // Only sample data where every frame is a fixed number of bytes of PCM or IEEE float is handled here,
+    // the other AIFF-C compression types would need a real decoder.
+    
+    UInt32 compressionType = NoneType;
+    
+    format->numChannels     = CFSwapInt16(extCommPtr->numChannels);
+    format->numSampleFrames = CFSwapInt32(extCommPtr->numSampleFrames);
+    format->sampleSize      = CFSwapInt16(extCommPtr->sampleSize);
+    format->bytesPerSample  = (format->sampleSize + 7) / 8;
+    format->isFloat         = FALSE;
+    format->isLittleEndian  = FALSE;
+    x80told(&extCommPtr->sampleRate, &format->sampleRate);
+    
+    if (isCompressed) {
+        compressionType = CFSwapInt32(extCommPtr->compressionType);
+    }
+    
+    switch (compressionType) {
+            
+        case NoneType:
+        case 'twos':
+        case 'in24':
+        case 'in32':
+            break;
+            
+        case 'sowt':
+        case '42ni':
+        case '23ni':
+            format->isLittleEndian = TRUE;
+            break;
+            
+        case 'fl32':
+        case 'FL32':
+            format->isFloat = TRUE;
+            format->bytesPerSample = 4;
+            break;
+            
+        case 'fl64':
+        case 'FL64':
+            format->isFloat = TRUE;
+            format->bytesPerSample = 8;
+            break;
+            
+        default:
+            return FALSE;
+    }
+    
+    if (format->numChannels < 1 || format->bytesPerSample < 1 || (!format->isFloat && format->bytesPerSample > 4)) {
+        return FALSE;
+    }
+    
+    return TRUE;
+}
+
+
+void decodeSamples(const UInt8 * src, size_t numFrames, const SampleFormat * format, float ** channels, size_t channelOffset) {
+    
+    // Deinterleave numFrames frames into per channel float buffers starting at channels[c][channelOffset].
+    // Integer samples are left justified in their bytes so every width is treated as a 32 bit integer and scaled to +/-1.0.
+    
+    size_t bytesPerFrame = format->numChannels * format->bytesPerSample;
+    int bytesPerSample = format->bytesPerSample;
+    
+    for (int c = 0; c < format->numChannels; c++) {
+        
+        const UInt8 * p = src + c * bytesPerSample;
+        float * out = channels[c] + channelOffset;
+        
+        if (format->isFloat && bytesPerSample == 4) {
+            for (size_t f = 0; f < numFrames; f++, p += bytesPerFrame) {
+                UInt32 bits = ((UInt32) p[0] << 24) | ((UInt32) p[1] << 16) | ((UInt32) p[2] << 8) | p[3];
+                float v;
+                memcpy(&v, &bits, sizeof(v));
+                out[f] = v;
+            }
+        }
+        else if (format->isFloat) {
+            for (size_t f = 0; f < numFrames; f++, p += bytesPerFrame) {
+                UInt64 bits = 0;
+                for (int b = 0; b < 8; b++) {
+                    bits = (bits << 8) | p[b];
+                }
+                double v;
+                memcpy(&v, &bits, sizeof(v));
+                out[f] = (float) v;
+            }
+        }
+        else {
+            for (size_t f = 0; f < numFrames; f++, p += bytesPerFrame) {
+                UInt32 bits = 0;
+                for (int b = 0; b < bytesPerSample; b++) {
+                    UInt8 byte = format->isLittleEndian ? p[bytesPerSample - 1 - b] : p[b];
+                    bits |= (UInt32) byte << (24 - 8 * b);
+                }
+                out[f] = (float) (SInt32) bits * (1.0f / 2147483648.0f);
+            }
+        }
+    }
+}
+
+
+void encodeSamples(float ** channels, size_t numFrames, const SampleFormat * format, UInt8 * dst) {
+    
+    // Interleave per channel float buffers back into the file's sample format. Integer samples are rounded and
+    // clipped to sampleSize bits (no dither) then left justified in their bytes.
+    
+    size_t bytesPerFrame = format->numChannels * format->bytesPerSample;
+    int bytesPerSample = format->bytesPerSample;
+    double maxValue = ldexp(1.0, format->sampleSize - 1);
+    int shift = 32 - format->sampleSize;
+    
+    for (int c = 0; c < format->numChannels; c++) {
+        
+        UInt8 * p = dst + c * bytesPerSample;
+        const float * in = channels[c];
+        
+        if (format->isFloat && bytesPerSample == 4) {
+            for (size_t f = 0; f < numFrames; f++, p += bytesPerFrame) {
+                UInt32 bits;
+                memcpy(&bits, &in[f], sizeof(bits));
+                p[0] = bits >> 24;
+                p[1] = bits >> 16;
+                p[2] = bits >> 8;
+                p[3] = bits;
+            }
+        }
+        else if (format->isFloat) {
+            for (size_t f = 0; f < numFrames; f++, p += bytesPerFrame) {
+                double v = in[f];
+                UInt64 bits;
+                memcpy(&bits, &v, sizeof(bits));
+                for (int b = 0; b < 8; b++) {
+                    p[b] = bits >> (56 - 8 * b);
+                }
+            }
+        }
+        else {
+            for (size_t f = 0; f < numFrames; f++, p += bytesPerFrame) {
+                double v = rint(in[f] * maxValue);
+                if (v > maxValue - 1.0) {
+                    v = maxValue - 1.0;
+                }
+                else if (v < -maxValue) {
+                    v = -maxValue;
+                }
+                UInt32 bits = (UInt32) (SInt32) v << shift;
+                for (int b = 0; b < bytesPerSample; b++) {
+                    UInt8 byte = bits >> (24 - 8 * b);
+                    if (format->isLittleEndian) {
+                        p[bytesPerSample - 1 - b] = byte;
+                    }
+                    else {
+                        p[b] = byte;
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+ssize_t writeAIFFHeader(int fd, ExtCommonChunkPtr extCommPtr, Boolean isCompressed, const SampleFormat * format,
+                        UInt32 numSampleFrames, long double sampleRate, UInt32 ssndOffset, UInt32 ssndBlockSize) {
+    
+    // Write FORM, FVER (AIFF-C only), COMM and the SSND chunk header (plus ssndOffset bytes of zeros) for
+    // numSampleFrames frames of sample data that the caller writes next. The COMM chunk is a copy of extCommPtr
+    // (so AIFF-C compression type and name carry over) with the frame count and sample rate replaced.
+    // Returns the number of bytes written, or -1 on error.
+    
+    size_t commSize = sizeof(ChunkHeader) + padOddSize(CFSwapInt32(extCommPtr->ckSize));
+    UInt64 dataSize = (UInt64) numSampleFrames * format->numChannels * format->bytesPerSample;
+    UInt64 ssndSize = 2 * sizeof(UInt32) + ssndOffset + dataSize;
+    UInt64 formSize = sizeof(containerChunkPtr->formType) + commSize + sizeof(ChunkHeader) + padOddSize(ssndSize);
+    
+    if (commSize > maxChunkSize) {
+        fprintf(stderr, "ERROR: \'COMM\' chunk size %zu larger than expected\n", commSize);
+        return -1;
+    }
+    
+    if (isCompressed) {
+        formSize += sizeof(FormatVersionChunk);
+    }
+    
+    if (formSize > UINT32_MAX) {
+        fprintf(stderr, "ERROR: %llu bytes of sample data is too large for an AIFF/AIFF-C file\n", dataSize);
+        return -1;
+    }
+    
+    size_t headerSize = sizeof(ContainerChunk) + sizeof(FormatVersionChunk) + commSize + sizeof(SoundDataChunk) + ssndOffset;
+    UInt8 * header = calloc(1, headerSize);
+    UInt8 * p = header;
+    
+    if (header == NULL) {
+        fprintf(stderr, "calloc(1, headerSize = %zu) failed\n", headerSize);
+        return -1;
+    }
+    
+    ContainerChunkPtr form = (ContainerChunkPtr) p;
+    form->ckID     = CFSwapInt32(FORMID);
+    form->ckSize   = CFSwapInt32((UInt32) formSize);
+    form->formType = CFSwapInt32(isCompressed ? AIFCID : AIFFID);
+    p += sizeof(ContainerChunk);
+    
+    if (isCompressed) {
+        FormatVersionChunkPtr fver = (FormatVersionChunkPtr) p;
+        fver->ckID      = CFSwapInt32(FormatVersionID);
+        fver->ckSize    = CFSwapInt32(sizeof(fver->timestamp));
+        fver->timestamp = CFSwapInt32(AIFCVersion1);
+        p += sizeof(FormatVersionChunk);
+    }
+    
+    memcpy(p, extCommPtr, commSize);
+    ExtCommonChunkPtr comm = (ExtCommonChunkPtr) p;
+    comm->numSampleFrames = CFSwapInt32(numSampleFrames);
+    ldtox80(&sampleRate, &comm->sampleRate);
+    p += commSize;
+    
+    SoundDataChunkPtr ssnd = (SoundDataChunkPtr) p;
+    ssnd->ckID      = CFSwapInt32(SoundDataID);
+    ssnd->ckSize    = CFSwapInt32((UInt32) ssndSize);
+    ssnd->offset    = CFSwapInt32(ssndOffset);
+    ssnd->blockSize = CFSwapInt32(ssndBlockSize);
+    p += sizeof(SoundDataChunk) + ssndOffset;
+    
+    ssize_t ret = throttledWrite(fd, header, p - header);
+    
+    if (ret != p - header) {
+        fprintf(stderr, "ERROR: write(fd=%d, header, %ld) = %zd : %s\n", fd, (long) (p - header), ret, strerror(errno));
+        ret = -1;
+    }
+    
+    free(header);
+    
+    return ret;
+}
+
+
+double besselI0(double x) {
+    
+    // Zeroth order modified Bessel function of the first kind, for the Kaiser window.
+    
+    double sum = 1.0;
+    double term = 1.0;
+    
+    for (int k = 1; k < 100; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < sum * 1e-12) {
+            break;
+        }
+    }
+    
+    return sum;
+}
+
+
+Boolean initResampler(Resampler * resampler, UInt32 inRate, UInt32 outRate) {
+    
+    // Build the polyphase table. Row p holds the filter taps for an interpolation point p/kResamplePhases of
+    // an input frame past the centre tap. When downsampling the cutoff drops to the output Nyquist and the
+    // filter gets proportionally longer. Each row is normalised to unity gain at DC.
+    
+    double ratio = (double) outRate / inRate;
+    double scale = ratio < 1.0 ? ratio : 1.0;
+    double cutoff = resampleCutoff * scale;
+    double i0Beta = besselI0(resampleKaiserBeta);
+    
+    resampler->inRate   = inRate;
+    resampler->outRate  = outRate;
+    resampler->halfTaps = (int) ceil(kResampleZeroCrossings / scale);
+    resampler->halfTaps += resampler->halfTaps % 2;     // resampleChannel() takes 4 taps at a time
+    resampler->numTaps  = 2 * resampler->halfTaps;
+    resampler->coefs    = malloc((size_t) (kResamplePhases + 1) * resampler->numTaps * sizeof(float));
+    
+    if (resampler->coefs == NULL) {
+        fprintf(stderr, "malloc() of %d resampler filter taps failed\n", (kResamplePhases + 1) * resampler->numTaps);
+        return FALSE;
+    }
+    
+    for (int p = 0; p <= kResamplePhases; p++) {
+        
+        float * row = resampler->coefs + (size_t) p * resampler->numTaps;
+        double sum = 0.0;
+        
+        for (int j = 0; j < resampler->numTaps; j++) {
+            double t = j - (resampler->halfTaps - 1) - (double) p / kResamplePhases;   // input frames from the interpolation point
+            double x = t / resampler->halfTaps;
+            double window = fabs(x) >= 1.0 ? 0.0 : besselI0(resampleKaiserBeta * sqrt(1.0 - x * x)) / i0Beta;
+            double sinc = t == 0.0 ? 1.0 : sin(M_PI * cutoff * t) / (M_PI * cutoff * t);
+            double coef = cutoff * sinc * window;
+            
+            row[j] = (float) coef;
+            sum += coef;
+        }
+        
+        for (int j = 0; j < resampler->numTaps; j++) {
+            row[j] = (float) (row[j] / sum);
+        }
+    }
+    
+    return TRUE;
+}
+
+
+void * resampleChannel(void * argsPtr) {
+    
+    // Produce numOut output frames for one channel. The inner loop is written with independent accumulators
+    // over contiguous taps so the compiler vectorizes it.
+    
+    ResampleChannelArgs * args = (ResampleChannelArgs *) argsPtr;
+    const Resampler * resampler = args->resampler;
+    int numTaps = resampler->numTaps;
+    
+    for (size_t k = 0; k < args->numOut; k++) {
+        
+        UInt64 position = (args->firstOut + k) * resampler->inRate;     // input frame position, times outRate
+        SInt64 centre = (SInt64) (position / resampler->outRate);
+        double phase = (double) (position % resampler->outRate) * kResamplePhases / resampler->outRate;
+        int p = (int) phase;
+        float a = (float) (phase - p);
+        
+        const float * restrict c0 = resampler->coefs + (size_t) p * numTaps;
+        const float * restrict c1 = c0 + numTaps;
+        const float * restrict x = args->in + (centre - (resampler->halfTaps - 1) - args->inBase);
+        float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+        
+        for (int j = 0; j < numTaps; j += 4) {
+            s0 += x[j]     * (c0[j]     + a * (c1[j]     - c0[j]));
+            s1 += x[j + 1] * (c0[j + 1] + a * (c1[j + 1] - c0[j + 1]));
+            s2 += x[j + 2] * (c0[j + 2] + a * (c1[j + 2] - c0[j + 2]));
+            s3 += x[j + 3] * (c0[j + 3] + a * (c1[j + 3] - c0[j + 3]));
+        }
+        
+        args->out[k] = (s0 + s1) + (s2 + s3);
+    }
+    
+    return NULL;
+}
+
+
+void * convertFile(void * jobPtr) {
+    
+    // Stream the SSND sample data through the resampler in blocks of kResampleBlockFrames input frames and
+    // write a new file at the output rate. Channels within a block are resampled on their own threads, unless
+    // other files are converting at the same time and the threads would be more than the cores. Written to a
+    // temporary file that is renamed when complete, so a stopped run never leaves a partial converted file.
+    // Runs on a conversion thread, so nothing here may touch the chunk walking globals.
+    
+    ConvertJob * job = (ConvertJob *) jobPtr;
+    const SampleFormat * format = &job->format;
+    Resampler resampler = { 0 };
+    int inFd = -1;
+    int outFd = -1;
+    int numChannels = format->numChannels;
+    size_t bytesPerFrame = numChannels * format->bytesPerSample;
+    UInt64 numOutFrames = ((UInt64) format->numSampleFrames * job->outRate + job->inRate - 1) / job->inRate;
+    float ** inChannels = calloc(numChannels, sizeof(float *));
+    float ** outChannels = calloc(numChannels, sizeof(float *));
+    ResampleChannelArgs * channelArgs = calloc(numChannels, sizeof(ResampleChannelArgs));
+    pthread_t * channelThreads = calloc(numChannels, sizeof(pthread_t));
+    UInt8 * readBuffer = NULL;
+    UInt8 * writeBuffer = NULL;
+    char * tempName = NULL;
+    struct timespec startTime, endTime;
+    
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    
+    pthread_mutex_lock(&convertMutex);
+    activeConversions++;
+    pthread_mutex_unlock(&convertMutex);
+    
+    if (inChannels == NULL || outChannels == NULL || channelArgs == NULL || channelThreads == NULL) {
+        fprintf(stderr, "ERROR: %s: calloc() failed, skipping conversion\n", job->inFileName);
+        goto done;
+    }
+    
+    if (numOutFrames > UINT32_MAX) {
+        fprintf(stderr, "ERROR: %s: %llu converted sample frames is too many for an AIFF/AIFF-C file, skipping conversion\n", job->inFileName, numOutFrames);
+        goto done;
+    }
+    
+    if (!initResampler(&resampler, job->inRate, job->outRate)) {
+        goto done;
+    }
+    
+    size_t inCapacity  = kResampleBlockFrames + 3 * resampler.numTaps + job->inRate / job->outRate + 2;
+    size_t outCapacity = (UInt64) inCapacity * job->outRate / job->inRate + 2;
+    
+    readBuffer  = malloc(kResampleBlockFrames * bytesPerFrame);
+    writeBuffer = malloc(outCapacity * bytesPerFrame);
+    
+    for (int c = 0; c < numChannels; c++) {
+        inChannels[c]  = calloc(inCapacity, sizeof(float));
+        outChannels[c] = calloc(outCapacity, sizeof(float));
+        if (inChannels[c] == NULL || outChannels[c] == NULL) {
+            readBuffer = NULL;
+        }
+    }
+    
+    if (readBuffer == NULL || writeBuffer == NULL) {
+        fprintf(stderr, "ERROR: %s: sample buffer allocation failed, skipping conversion\n", job->inFileName);
+        goto done;
+    }
+    
+    if ((inFd = throttledOpen(job->inFileName, O_RDONLY, 0)) == -1) {
+        fprintf(stderr, "ERROR: %s: %s, not readable, skipping conversion\n", job->inFileName, strerror(errno));
+        goto done;
+    }
+    
+    if (!noWriteOpt) {
+        asprintf(&tempName, "%s.affix-tmp", job->outFileName);
+        
+        if ((outFd = throttledOpen(tempName, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+            fprintf(stderr, "ERROR: %s: %s, can not create converted file, skipping conversion\n", tempName, strerror(errno));
+            goto done;
+        }
+        
+        if (writeAIFFHeader(outFd, job->commonChunkPtr, job->isCompressed, format, (UInt32) numOutFrames, (long double) job->outRate, 0, 0) == -1) {
+            goto done;
+        }
+    }
+    
+    // The channel buffers start with halfTaps - 1 frames of silence so the first window is full, and
+    // numTaps frames of silence are appended after the last input frame to flush out the tail.
+    
+    SInt64 inBase = -(resampler.halfTaps - 1);          // input frame number held in inChannels[c][0]
+    size_t inLength = resampler.halfTaps - 1;
+    UInt32 framesRead = 0;
+    Boolean flushed = FALSE;
+    UInt64 nextOut = 0;
+    
+    while (nextOut < numOutFrames) {
+        
+        if (framesRead < format->numSampleFrames) {
+            
+            size_t n = format->numSampleFrames - framesRead;
+            if (n > kResampleBlockFrames) {
+                n = kResampleBlockFrames;
+            }
+            
+            ssize_t r = throttledPread(inFd, readBuffer, n * bytesPerFrame, job->sampleDataOffset + (off_t) framesRead * bytesPerFrame);
+            
+            if (r != n * bytesPerFrame) {
+                fprintf(stderr, "ERROR: %s: sample data is truncated, expected %zu bytes at sample frame %u, read %zd, skipping conversion\n",
+                        job->inFileName, n * bytesPerFrame, framesRead, r);
+                goto done;
+            }
+            
+            decodeSamples(readBuffer, n, format, inChannels, inLength);
+            inLength   += n;
+            framesRead += (UInt32) n;
+        }
+        else if (!flushed) {
+            for (int c = 0; c < numChannels; c++) {
+                memset(inChannels[c] + inLength, 0, resampler.numTaps * sizeof(float));
+            }
+            inLength += resampler.numTaps;
+            flushed = TRUE;
+        }
+        else {
+            fprintf(stderr, "ERROR: %s: resampler stalled at output frame %llu of %llu, skipping conversion\n", job->inFileName, nextOut, numOutFrames);
+            goto done;
+        }
+        
+        // Every output frame whose window is now complete in the buffer.
+        
+        SInt64 lastCentre = inBase + (SInt64) inLength - resampler.halfTaps - 1;
+        UInt64 endOut = lastCentre < 0 ? 0 : ((UInt64) (lastCentre + 1) * job->outRate + job->inRate - 1) / job->inRate;
+        
+        if (endOut > numOutFrames) {
+            endOut = numOutFrames;
+        }
+        
+        size_t numOut = endOut > nextOut ? (size_t) (endOut - nextOut) : 0;
+        
+        if (numOut > 0) {
+            
+            pthread_mutex_lock(&convertMutex);
+            Boolean channelThreadsFit = activeConversions * numChannels <= maxConvertThreads;
+            pthread_mutex_unlock(&convertMutex);
+            
+            for (int c = 0; c < numChannels; c++) {
+                channelArgs[c].resampler = &resampler;
+                channelArgs[c].in        = inChannels[c];
+                channelArgs[c].inBase    = inBase;
+                channelArgs[c].firstOut  = nextOut;
+                channelArgs[c].numOut    = numOut;
+                channelArgs[c].out       = outChannels[c];
+                
+                if (numChannels == 1 || !channelThreadsFit ||
+                    pthread_create(&channelThreads[c], NULL, resampleChannel, &channelArgs[c]) != 0) {
+                    resampleChannel(&channelArgs[c]);
+                    channelThreads[c] = 0;
+                }
+            }
+            
+            for (int c = 0; c < numChannels; c++) {
+                if (channelThreads[c] != 0) {
+                    pthread_join(channelThreads[c], NULL);
+                }
+            }
+            
+            if (outFd != -1) {
+                encodeSamples(outChannels, numOut, format, writeBuffer);
+                
+                ssize_t w = throttledWrite(outFd, writeBuffer, numOut * bytesPerFrame);
+                
+                if (w != numOut * bytesPerFrame) {
+                    fprintf(stderr, "ERROR: %s: write() = %zd, expected %zu : %s, skipping conversion\n", tempName, w, numOut * bytesPerFrame, strerror(errno));
+                    goto done;
+                }
+            }
+            
+            nextOut = endOut;
+        }
+        
+        // Drop input frames no later window needs.
+        
+        SInt64 nextStart = (SInt64) (nextOut * job->inRate / job->outRate) - (resampler.halfTaps - 1);
+        size_t drop = nextStart > inBase ? (size_t) (nextStart - inBase) : 0;
+        
+        if (drop > inLength) {
+            drop = inLength;
+        }
+        
+        if (drop > 0) {
+            for (int c = 0; c < numChannels; c++) {
+                memmove(inChannels[c], inChannels[c] + drop, (inLength - drop) * sizeof(float));
+            }
+            inBase   += drop;
+            inLength -= drop;
+        }
+    }
+    
+    if (outFd != -1 && (numOutFrames * bytesPerFrame) % 2) {
+        UInt8 pad = 0;
+        if (throttledWrite(outFd, &pad, 1) != 1) {
+            fprintf(stderr, "ERROR: %s: write() of pad byte failed : %s\n", tempName, strerror(errno));
+            goto done;
+        }
+    }
+    
+    if (outFd != -1) {
+        
+        int closeFd = outFd;
+        
+        outFd = -1;
+        
+        if (fsync(closeFd) == -1 || close(closeFd) == -1) {
+            fprintf(stderr, "ERROR: %s: %s, write failed, skipping conversion\n", tempName, strerror(errno));
+            unlink(tempName);
+            goto done;
+        }
+        
+        if (rename(tempName, job->outFileName) == -1) {
+            fprintf(stderr, "ERROR: %s: %s, can not rename %s, skipping conversion\n", job->outFileName, strerror(errno), tempName);
+            unlink(tempName);
+            goto done;
+        }
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &endTime);
+    
+    char * convertResult = NULL;
+    
+    if (verboseOpt) {
+        double seconds = (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec) * 1e-9;
+        double audioSeconds = (double) format->numSampleFrames / job->inRate;
+        
+        asprintf(&convertResult, "%s%s\tconverted from %u to %u\t%s\t%llu\t%.1fx real time\n", job->result,
+                 job->inFileName, job->inRate, job->outRate, noWriteOpt ? "(not written)" : job->outFileName, numOutFrames,
+                 seconds > 0.0 ? audioSeconds / seconds : 0.0);
+    }
+    else {
+        asprintf(&convertResult, "%s%s\tconverted to %u\t%s\n", job->result,
+                 job->inFileName, job->outRate, noWriteOpt ? "(not written)" : job->outFileName);
+    }
+    
+    if (convertResult != NULL) {
+        fputs(convertResult + strlen(job->result), stdout);
+        recordCheckpoint(job->argIndex, job->inFileName, convertResult);
+        free(convertResult);
+    }
+    
+done:
+    
+    if (inFd != -1) {
+        close(inFd);
+    }
+    
+    if (outFd != -1) {
+        close(outFd);
+        unlink(tempName);
+    }
+    
+    pthread_mutex_lock(&convertMutex);
+    activeConversions--;
+    pthread_mutex_unlock(&convertMutex);
+    
+    for (int c = 0; c < numChannels; c++) {
+        if (inChannels != NULL) {
+            free(inChannels[c]);
+        }
+        if (outChannels != NULL) {
+            free(outChannels[c]);
+        }
+    }
+    
+    free(inChannels);
+    free(outChannels);
+    free(channelArgs);
+    free(channelThreads);
+    free(readBuffer);
+    free(writeBuffer);
+    free(tempName);
+    free(resampler.coefs);
+    free(job->inFileName);
+    free(job->outFileName);
+    free(job->result);
+    free(job->commonChunkPtr);
+    free(job);
+    
+    return NULL;
+}
+
+
+Boolean queueConvertJob(const char * inFileName, long double inRate, long argIndex, const char * result) {
+    
+    // Hand the file just parsed to a conversion thread. Parsing uses the shared chunk buffers so it stays on
+    // the main thread, conversions of earlier files carry on while later files are parsed. When all
+    // maxConvertThreads are busy wait for the oldest one. Returns FALSE if the file is not being converted.
+    
+    SampleFormat format;
+    ConvertJob * job;
+    
+    if (soundDataChunkOffset == 0) {
+        fprintf(stderr, "%s: no \'SSND\' sound data chunk found, skipping conversion\n", inFileName);
+        return FALSE;
+    }
+    
+    if (!getSampleFormat(savedCommonChunkPtr, aiffIsCompressed, &format)) {
+        fprintf(stderr, "%s: compression type \'%s\' not supported for sample rate conversion, skipping conversion\n",
+                inFileName, stringFromUInt32(savedCommonChunkPtr->compressionType));
+        return FALSE;
+    }
+    
+    if (inRate < 1.0L) {
+        fprintf(stderr, "%s: invalid sample rate %.0Lf, skipping conversion\n", inFileName, inRate);
+        return FALSE;
+    }
+    
+    if (llroundl(inRate) == convertRate) {
+        fprintf(stderr, "%s: sample rate is already %u, skipping conversion\n", inFileName, convertRate);
+        return FALSE;
+    }
+    
+    if ((job = calloc(1, sizeof(ConvertJob))) == NULL || (job->commonChunkPtr = malloc(maxChunkSize)) == NULL) {
+        fprintf(stderr, "ERROR: %s: calloc() failed, skipping conversion\n", inFileName);
+        return FALSE;
+    }
+    
+    memcpy(job->commonChunkPtr, savedCommonChunkPtr, maxChunkSize);
+    job->inFileName       = strdup(inFileName);
+    job->outFileName      = numberedFileName(inFileName, convertRate);
+    job->argIndex         = argIndex;
+    job->result           = strdup(result);
+    job->isCompressed     = aiffIsCompressed;
+    job->format           = format;
+    job->sampleDataOffset = soundDataChunkOffset + sizeof(SoundDataChunk) + CFSwapInt32(savedSoundDataChunk.offset);
+    job->inRate           = (UInt32) llroundl(inRate);
+    job->outRate          = convertRate;
+    
+    if (debugOpt) {
+        fprintf(stderr, "DEBUG: queueConvertJob(): %s -> %s, %u -> %u, sample data at %lld\n",
+                job->inFileName, job->outFileName, job->inRate, job->outRate, job->sampleDataOffset);
+    }
+    
+    if (numConvertThreads == maxConvertThreads) {
+        pthread_join(convertThreads[0], NULL);
+        memmove(convertThreads, convertThreads + 1, (--numConvertThreads) * sizeof(pthread_t));
+    }
+    
+    if (pthread_create(&convertThreads[numConvertThreads], NULL, convertFile, job) != 0) {
+        convertFile(job);
+    }
+    else {
+        numConvertThreads++;
+    }
+    
+    return TRUE;
+}
+
+
+void finishConvertJobs(void) {
+    
+    for (int i = 0; i < numConvertThreads; i++) {
+        pthread_join(convertThreads[i], NULL);
+    }
+    numConvertThreads = 0;
+}
+
+
+char * numberedFileName(const char * inFileName, UInt32 number) {
+    
+    // music.aif -> music-48000.aif (converted) or music-2.aif (split), alongside the original.
+    
+    const char * slash = strrchr(inFileName, '/');
+    const char * dot = strrchr(inFileName, '.');
+    size_t stemLength = strlen(inFileName);
+    char * name = malloc(strlen(inFileName) + 16);
+    
+    if (dot != NULL && dot != inFileName && (slash == NULL || dot > slash + 1)) {
+        stemLength = dot - inFileName;
+    }
+    
+    sprintf(name, "%.*s-%u%s", (int) stemLength, inFileName, number, inFileName + stemLength);
+    
+    return name;
+}
+
+
+double monotonicSeconds(void) {
+    
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+
+void initTokenBucket(TokenBucket * bucket, double rate) {
+    
+    bucket->rate   = rate;
+    bucket->burst  = rate * ioBurstSeconds;
+    
+    if (bucket->burst < 1.0) {
+        bucket->burst = 1.0;
+    }
+    
+    bucket->tokens = bucket->burst;
+}
+
+
+double takeTokens(TokenBucket * bucket, double count, double elapsed) {
+    
+    // Refill for the elapsed time then take count tokens. Returns how long the caller must sleep to
+    // pay off any debt. Call with ioMutex held.
+    
+    if (bucket->rate <= 0.0) {
+        return 0.0;
+    }
+    
+    double rate = bucket->rate * ioRateScale;
+    
+    bucket->tokens += rate * elapsed;
+    
+    if (bucket->tokens > bucket->burst) {
+        bucket->tokens = bucket->burst;
+    }
+    
+    bucket->tokens -= count;
+    
+    return bucket->tokens < 0.0 ? -bucket->tokens / rate : 0.0;
+}
+
+
+void throttleIO(size_t bytes) {
+    
+    // Charge one I/O of bytes bytes against the budget, sleeping if the budget is spent.
+    
+    if (!ioBudgetOpt) {
+        return;
+    }
+    
+    pthread_mutex_lock(&ioMutex);
+    
+    double now = monotonicSeconds();
+    double elapsed = now - ioLastRefill;
+    double opsWait = takeTokens(&iopsBucket, 1.0, elapsed);
+    double bytesWait = takeTokens(&bytesBucket, (double) bytes, elapsed);
+    
+    ioLastRefill = now;
+    
+    pthread_mutex_unlock(&ioMutex);
+    
+    double wait = opsWait > bytesWait ? opsWait : bytesWait;
+    
+    if (wait > 0.0) {
+        struct timespec sleepTime;
+        sleepTime.tv_sec  = (time_t) wait;
+        sleepTime.tv_nsec = (long) ((wait - sleepTime.tv_sec) * 1e9);
+        nanosleep(&sleepTime, NULL);
+    }
+}
+
+
+void observeIOLatency(double seconds, size_t bytes) {
+    
+    // Feed a read's latency into the running average and adjust the rate scale.
+    
+    if (ioLatencyTarget <= 0.0) {
+        return;
+    }
+    
+    if (bytes > ioLatencySampleBytes) {
+        seconds *= ioLatencySampleBytes / bytes;
+    }
+    
+    pthread_mutex_lock(&ioMutex);
+    
+    ioLatencyAverage = ioLatencyAverage == 0.0 ? seconds : 0.8 * ioLatencyAverage + 0.2 * seconds;
+    
+    double now = monotonicSeconds();
+    
+    if (now - ioLastAdjust >= ioAdjustSeconds) {
+        
+        double oldScale = ioRateScale;
+        
+        if (ioLatencyAverage > ioLatencyTarget) {
+            ioRateScale *= 0.7;
+            if (ioRateScale < ioMinRateScale) {
+                ioRateScale = ioMinRateScale;
+            }
+        }
+        else {
+            ioRateScale += 0.05;
+            if (ioRateScale > 1.0) {
+                ioRateScale = 1.0;
+            }
+        }
+        
+        if (debugOpt && ioRateScale != oldScale) {
+            fprintf(stderr, "DEBUG: read latency %.2f ms, I/O rate scale %.2f\n", ioLatencyAverage * 1000.0, ioRateScale);
+        }
+        
+        ioLastAdjust = now;
+    }
+    
+    pthread_mutex_unlock(&ioMutex);
+}
+
+
+ssize_t throttledRead(int fd, void * buf, size_t size) {
+    
+    // read() for the chunk walk.
+    
+    if (headerCache != NULL && size < kHeaderCacheSize) {
+        
+        off_t position = lseek(fd, 0, SEEK_CUR);
+        ssize_t ret;
+        
+        if (position == -1) {
+            return -1;
+        }
+        
+        if ((ret = cachedPread(fd, buf, size, position)) > 0) {
+            lseek(fd, position + ret, SEEK_SET);
+        }
+        
+        return ret;
+    }
+    
+    throttleIO(size);
+    
+    double start = ioLatencyTarget > 0.0 ? monotonicSeconds() : 0.0;
+    ssize_t ret = read(fd, buf, size);
+    
+    if (start > 0.0) {
+        observeIOLatency(monotonicSeconds() - start, size);
+    }
+    
+    return ret;
+}
+
+
+ssize_t throttledPread(int fd, void * buf, size_t size, off_t offset) {
+    
+    throttleIO(size);
+    
+    double start = ioLatencyTarget > 0.0 ? monotonicSeconds() : 0.0;
+    ssize_t ret = pread(fd, buf, size, offset);
+    
+    if (start > 0.0) {
+        observeIOLatency(monotonicSeconds() - start, size);
+    }
+    
+    return ret;
+}
+
+
+ssize_t throttledWrite(int fd, const void * buf, size_t size) {
+    
+    throttleIO(size);
+    
+    return write(fd, buf, size);
+}
+
+
+ssize_t throttledPwrite(int fd, const void * buf, size_t size, off_t offset) {
+    
+    throttleIO(size);
+    
+    return pwrite(fd, buf, size, offset);
+}
+
+
+int throttledStat(const char * path, struct stat * sb) {
+    
+    throttleIO(0);
+    
+    return stat(path, sb);
+}
+
+
+int throttledAccess(const char * path, int mode) {
+    
+    throttleIO(0);
+    
+    return access(path, mode);
+}
+
+
+int throttledOpen(const char * path, int flags, mode_t mode) {
+    
+    throttleIO(0);
+    
+    return open(path, flags, mode);
+}
+
+
+ssize_t cachedPread(int fd, void * buf, size_t size, off_t offset) {
+    
+    // pread() for the chunk walk, served from headerCache when there is one. Main thread only.
+    
+    if (headerCache == NULL || size >= kHeaderCacheSize) {
+        return throttledPread(fd, buf, size, offset);
+    }
+    
+    if (fd != headerCacheFd || offset < headerCacheOffset || offset + size > headerCacheOffset + headerCacheLength) {
+        
+        ssize_t ret = throttledPread(fd, headerCache, kHeaderCacheSize, offset);
+        
+        if (ret == -1) {
+            forgetHeaderCache();
+            return -1;
+        }
+        
+        headerCacheFd     = fd;
+        headerCacheOffset = offset;
+        headerCacheLength = ret;
+    }
+    
+    size_t available = headerCacheOffset + headerCacheLength - offset;
+    
+    if (size > available) {
+        size = available;           // end of file
+    }
+    
+    memcpy(buf, headerCache + (offset - headerCacheOffset), size);
+    
+    return size;
+}
+
+
+void forgetHeaderCache(void) {
+    
+    // Call when the file is closed (so a reused descriptor can't hit stale data) or written.
+    
+    headerCacheFd = -1;
+    headerCacheLength = 0;
+}
+
+
+Boolean setIOPolicy(const char * policyName) {
+    
+    // Disk I/O priority for the whole process, see setiopolicy_np(3). throttle and utility yield to other
+    // processes' I/O, which is what you want when scanning a volume that is also serving playback.
+    
+    int policy;
+    
+    if (strcmp(policyName, "important") == 0) {
+        policy = IOPOL_IMPORTANT;
+    }
+    else if (strcmp(policyName, "standard") == 0) {
+        policy = IOPOL_STANDARD;
+    }
+    else if (strcmp(policyName, "utility") == 0) {
+        policy = IOPOL_UTILITY;
+    }
+    else if (strcmp(policyName, "throttle") == 0) {
+        policy = IOPOL_THROTTLE;
+    }
+    else if (strcmp(policyName, "passive") == 0) {
+        policy = IOPOL_PASSIVE;
+    }
+    else {
+        return FALSE;
+    }
+    
+    if (setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, policy) == -1) {
+        fprintf(stderr, "ERROR: setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, %s) : %s\n", policyName, strerror(errno));
+    }
+    
+    return TRUE;
+}
+
+
+void minMaxSamples(const float * samples, size_t numSamples, float * minSample, float * maxSample) {
+    
+    // Two independent min/max chains so the compiler can vectorize. numSamples must be at least 1.
+    
+    float lo0 = samples[0], hi0 = samples[0];
+    float lo1 = samples[0], hi1 = samples[0];
+    size_t i;
+    
+    for (i = 0; i + 2 <= numSamples; i += 2) {
+        lo0 = samples[i]     < lo0 ? samples[i]     : lo0;
+        hi0 = samples[i]     > hi0 ? samples[i]     : hi0;
+        lo1 = samples[i + 1] < lo1 ? samples[i + 1] : lo1;
+        hi1 = samples[i + 1] > hi1 ? samples[i + 1] : hi1;
+    }
+    
+    for (; i < numSamples; i++) {
+        lo0 = samples[i] < lo0 ? samples[i] : lo0;
+        hi0 = samples[i] > hi0 ? samples[i] : hi0;
+    }
+    
+    *minSample = lo0 < lo1 ? lo0 : lo1;
+    *maxSample = hi0 > hi1 ? hi0 : hi1;
+}
+
+
+SInt16 peakValue(float sample) {
+    
+    float v = rintf(sample * 32767.0f);
+    
+    if (v > 32767.0f) {
+        return 32767;
+    }
+    if (v < -32768.0f) {
+        return -32768;
+    }
+    
+    return (SInt16) v;
+}
+
+
+void resetChunkWalk(void) {
+    
+    // We keep count of chunks where there can only be one of that type in the file.
+    commChunkCount              = 0;
+    formatVersionChunkCount     = 0;
+    soundDataChunkCount         = 0;
+    markerChunkCount            = 0;
+    instrumentChunkCount        = 0;
+    midiDataChunkCount          = 0;
+    audioRecordingChunkCount    = 0;
+    commentChunkCount           = 0;
+    nameChunkCount              = 0;
+    authorChunkCount            = 0;
+    copyrightChunkCount         = 0;
+    soundDataChunkOffset        = 0;
+    numChunkTableEntries        = 0;
+    formChunkSize               = 0;
+    invalidFile                 = FALSE;
+    foundEOF                    = FALSE;
+}
+
+
+Boolean readChunkTable(int fd) {
+    
+    // Walk the chunks of the file on fd into the chunk table, for modes that rearrange chunks rather than just read them.
+    // Returns TRUE only if the file is valid and the chunks exactly fill the FORM, so nothing is lost by rewriting them.
+    
+    struct stat sb;
+    off_t expected = sizeof(ContainerChunk);
+    
+    resetChunkWalk();
+    getFORMChunk(fd, chunkHeaderPtr);
+    
+    // Anything after the end of the FORM isn't part of the file's AIFF data.
+    
+    while (!invalidFile && lseek(fd, 0, SEEK_CUR) < sizeof(ChunkHeader) + (off_t) formChunkSize && getChunks(fd, chunkHeaderPtr)) {
+    }
+    
+    forgetHeaderCache();
+    
+    if (invalidFile || commChunkCount != 1) {
+        return FALSE;
+    }
+    
+    for (int c = 0; c < numChunkTableEntries; c++) {
+        if (chunkTable[c].offset != expected) {
+            break;
+        }
+        expected += sizeof(ChunkHeader) + padOddSize(chunkTable[c].ckSize);
+    }
+    
+    if (fstat(fd, &sb) == -1 || expected != sizeof(ChunkHeader) + (off_t) formChunkSize || sb.st_size < expected) {
+        fprintf(stderr, "%s: chunks do not fill the \'FORM\' chunk exactly or the file is truncated, run affix -x for details\n", fileName);
+        return FALSE;
+    }
+    
+    return TRUE;
+}
+
+
+void addChunkTableEntry(UInt32 ckID, off_t offset, UInt32 ckSize) {
+    
+    if (numChunkTableEntries == chunkTableCapacity) {
+        chunkTableCapacity = chunkTableCapacity == 0 ? 32 : 2 * chunkTableCapacity;
+        if ((chunkTable = realloc(chunkTable, chunkTableCapacity * sizeof(ChunkTableEntry))) == NULL) {
+            fprintf(stderr, "ERROR: out of memory for chunk table\n");
+            exit(-1);
+        }
+    }
+    
+    chunkTable[numChunkTableEntries].ckID   = ckID;
+    chunkTable[numChunkTableEntries].offset = offset;
+    chunkTable[numChunkTableEntries].ckSize = ckSize;
+    numChunkTableEntries++;
+}
+
+
+Boolean soundDataBytesPerFrame(UInt32 * bytesPerFrame) {
+    
+    // Bytes of SSND sample data per sample frame, for the formats where that is fixed.
+    
+    SampleFormat format;
+    
+    if (getSampleFormat(savedCommonChunkPtr, aiffIsCompressed, &format)) {
+        *bytesPerFrame = format.numChannels * format.bytesPerSample;
+        return TRUE;
+    }
+    
+    switch (CFSwapInt32(savedCommonChunkPtr->compressionType)) {
+        case 'ulaw':
+        case 'ULAW':
+        case 'alaw':
+        case 'ALAW':
+            *bytesPerFrame = CFSwapInt16(savedCommonChunkPtr->numChannels);
+            return *bytesPerFrame > 0;
+        default:
+            return FALSE;
+    }
+}
+
+
+void verifyFile(int fd, const char * inFileName) {
+    
+    // Check the file is as long as its chunk sizes claim, that SSND holds the sample frames COMM says it does,
+    // and that the sample data has no holes left by an interrupted copy. Only the headers the chunk walk already
+    // read and file system metadata are used, the sample data itself is never read.
+    
+    struct stat sb;
+    int problems = 0;
+    off_t formEnd = sizeof(ChunkHeader) + (off_t) formChunkSize;
+    
+    if (fstat(fd, &sb) == -1) {
+        fprintf(stderr, "ERROR: %s: %s, fstat() failed\n", inFileName, strerror(errno));
+        return;
+    }
+    
+    if (sb.st_size < formEnd) {
+        resultPrintf("%s\tverify\ttruncated: 'FORM' chunk size needs %lld bytes, file is %lld bytes, %lld missing\n",
+                     inFileName, (long long) formEnd, (long long) sb.st_size, (long long) (formEnd - sb.st_size));
+        problems++;
+    }
+    else if (sb.st_size > padOddSize(formEnd)) {
+        resultPrintf("%s\tverify\t%lld bytes after the end of the 'FORM' chunk\n",
+                     inFileName, (long long) (sb.st_size - padOddSize(formEnd)));
+        problems++;
+    }
+    
+    for (int c = 0; c < numChunkTableEntries; c++) {
+        
+        ChunkTableEntry * chunk = &chunkTable[c];
+        off_t chunkEnd = chunk->offset + sizeof(ChunkHeader) + chunk->ckSize;
+        char id[5];
+        
+        if (chunk->offset >= formEnd) {
+            break;          // data after the FORM, reported above
+        }
+        
+        snprintf(id, sizeof(id), "%c%c%c%c", chunk->ckID >> 24, chunk->ckID >> 16, chunk->ckID >> 8, chunk->ckID);
+        
+        if (chunkEnd > sb.st_size) {
+            off_t present = sb.st_size - chunk->offset - (off_t) sizeof(ChunkHeader);
+            resultPrintf("%s\tverify\ttruncated: '%s' chunk at offset %lld needs %u bytes, only %lld in file\n",
+                         inFileName, id, (long long) chunk->offset, chunk->ckSize, (long long) (present > 0 ? present : 0));
+            problems++;
+        }
+        else if (chunkEnd > formEnd) {
+            resultPrintf("%s\tverify\t'%s' chunk at offset %lld ends %lld bytes past the end of the 'FORM' chunk\n",
+                         inFileName, id, (long long) chunk->offset, (long long) (chunkEnd - formEnd));
+            problems++;
+        }
+    }
+    
+    // The chunk walk has already rejected files with a missing or repeated chunk, say so here too so that -x
+    // never reports ok for a file the other modes skip.
+    
+    struct { unsigned int count; const char * id; } chunkCounts[] = {
+        { commChunkCount,           "COMM" },
+        { formatVersionChunkCount,  "FVER" },
+        { soundDataChunkCount,      "SSND" },
+        { markerChunkCount,         "MARK" },
+        { instrumentChunkCount,     "INST" },
+        { midiDataChunkCount,       "MIDI" },
+        { audioRecordingChunkCount, "AESD" },
+        { commentChunkCount,        "COMT" },
+        { nameChunkCount,           "NAME" },
+        { authorChunkCount,         "AUTH" },
+        { copyrightChunkCount,      "(c) " }
+    };
+    
+    if (commChunkCount == 0) {
+        resultPrintf("%s\tverify\tno 'COMM' common chunk\n", inFileName);
+        problems++;
+    }
+    
+    for (int n = 0; n < sizeof(chunkCounts) / sizeof(chunkCounts[0]); n++) {
+        if (chunkCounts[n].count > 1) {
+            resultPrintf("%s\tverify\t%u '%s' chunks, only one is allowed\n", inFileName, chunkCounts[n].count, chunkCounts[n].id);
+            problems++;
+        }
+    }
+    
+    if (invalidFile && problems == 0) {
+        resultPrintf("%s\tverify\tinvalid AIFF/AIFF-C file, see the message on stderr\n", inFileName);
+        problems++;
+    }
+    
+    if (commChunkCount == 1 && !invalidFile) {
+        
+        UInt32 numSampleFrames = CFSwapInt32(savedCommonChunkPtr->numSampleFrames);
+        UInt32 bytesPerFrame;
+        
+        if (soundDataChunkOffset == 0) {
+            if (numSampleFrames > 0) {
+                resultPrintf("%s\tverify\tno 'SSND' sound data chunk, 'COMM' claims %u sample frames\n", inFileName, numSampleFrames);
+                problems++;
+            }
+        }
+        else if (soundDataBytesPerFrame(&bytesPerFrame)) {
+            
+            // ckSize covers the offset and blockSize fields, the offset bytes, then the sample frames.
+            
+            UInt64 ssndSize = CFSwapInt32(savedSoundDataChunk.ckSize);
+            UInt64 headerSize = sizeof(SoundDataChunk) - sizeof(ChunkHeader) + CFSwapInt32(savedSoundDataChunk.offset);
+            UInt64 expectedSize = headerSize + (UInt64) numSampleFrames * bytesPerFrame;
+            
+            if (ssndSize < expectedSize) {
+                resultPrintf("%s\tverify\t'SSND' chunk holds %llu sample frames, 'COMM' claims %u\n",
+                             inFileName, ssndSize > headerSize ? (ssndSize - headerSize) / bytesPerFrame : 0ULL, numSampleFrames);
+                problems++;
+            }
+            else if (ssndSize > expectedSize) {
+                resultPrintf("%s\tverify\t'SSND' chunk has %llu bytes more than the %u sample frames 'COMM' claims\n",
+                             inFileName, ssndSize - expectedSize, numSampleFrames);
+                problems++;
+            }
+        }
+        else if (debugOpt) {
+            fprintf(stderr, "DEBUG: %s: 'SSND' size not checked, compression type %s has no fixed frame size\n",
+                    inFileName, stringFromUInt32(savedCommonChunkPtr->compressionType));
+        }
+        
+#ifdef SEEK_HOLE
+        
+        // Copies that were interrupted, or preallocated and never finished, leave unwritten holes that read back as zeros.
+        // Asking the file system for holes in the sample data finds them without reading it. File systems that don't
+        // track holes report a single hole at end of file, which is never inside the sample data.
+        
+        if (soundDataChunkOffset != 0) {
+            
+            off_t dataStart = soundDataChunkOffset + sizeof(SoundDataChunk) + CFSwapInt32(savedSoundDataChunk.offset);
+            off_t dataEnd = soundDataChunkOffset + sizeof(ChunkHeader) + CFSwapInt32(savedSoundDataChunk.ckSize);
+            off_t holeStart = dataStart;
+            
+            if (dataEnd > sb.st_size) {
+                dataEnd = sb.st_size;
+            }
+            
+            throttleIO(0);
+            
+            while (holeStart < dataEnd && (holeStart = lseek(fd, holeStart, SEEK_HOLE)) != -1 && holeStart < dataEnd) {
+                
+                off_t holeEnd = lseek(fd, holeStart, SEEK_DATA);
+                
+                if (holeEnd == -1 || holeEnd > dataEnd) {
+                    holeEnd = dataEnd;      // ENXIO, no data after the hole
+                }
+                
+                resultPrintf("%s\tverify\t%s of %lld unwritten bytes (a hole) in the sample data at offset %lld\n",
+                             inFileName, holeEnd == dataEnd ? "tail" : "gap", (long long) (holeEnd - holeStart), (long long) holeStart);
+                problems++;
+                holeStart = holeEnd;
+            }
+        }
+        
+#endif
+        
+    }
+    
+    if (problems == 0) {
+        resultPrintf("%s\tverify\tok\n", inFileName);
+    }
+}
+
+
+Boolean writePeakFile(int fd, const char * inFileName) {
+    
+    // Write inFileName.peaks from the SSND sample data found by the chunk walk.
+    
+    SampleFormat format;
+    Boolean ok = FALSE;
+    int peakFd = -1;
+    
+    if (soundDataChunkOffset == 0) {
+        fprintf(stderr, "%s: no \'SSND\' sound data chunk found, no peaks written\n", inFileName);
+        return FALSE;
+    }
+    
+    if (!getSampleFormat(savedCommonChunkPtr, aiffIsCompressed, &format)) {
+        fprintf(stderr, "%s: compression type \'%s\' not supported for peaks, no peaks written\n",
+                inFileName, stringFromUInt32(savedCommonChunkPtr->compressionType));
+        return FALSE;
+    }
+    
+    int numChannels = format.numChannels;
+    size_t bytesPerFrame = numChannels * format.bytesPerSample;
+    off_t sampleDataOffset = soundDataChunkOffset + sizeof(SoundDataChunk) + CFSwapInt32(savedSoundDataChunk.offset);
+    size_t binBytes = numChannels * 2 * sizeof(SInt16);
+    char * peakFileName = malloc(strlen(inFileName) + sizeof(".peaks"));
+    UInt8 * readBuffer = malloc(kPeakBlockFrames * bytesPerFrame);
+    UInt8 * writeBuffer = malloc((kPeakBlockFrames / peakFramesPerBin[0]) * binBytes);
+    float ** channels = calloc(numChannels, sizeof(float *));
+    float * binMin[kPeakLevels] = { NULL };
+    float * binMax[kPeakLevels] = { NULL };
+    size_t maxBlockBins[kPeakLevels];
+    PeakFileHeader fileHeader;
+    PeakLevelHeader levelHeaders[kPeakLevels];
+    Boolean allocated = peakFileName != NULL && readBuffer != NULL && writeBuffer != NULL && channels != NULL;
+    
+    for (int c = 0; c < numChannels && allocated; c++) {
+        allocated = (channels[c] = malloc(kPeakBlockFrames * sizeof(float))) != NULL;
+    }
+    
+    for (int l = 0; l < kPeakLevels && allocated; l++) {
+        maxBlockBins[l] = kPeakBlockFrames / peakFramesPerBin[l];
+        binMin[l] = malloc(numChannels * maxBlockBins[l] * sizeof(float));
+        binMax[l] = malloc(numChannels * maxBlockBins[l] * sizeof(float));
+        allocated = binMin[l] != NULL && binMax[l] != NULL;
+    }
+    
+    if (!allocated) {
+        fprintf(stderr, "ERROR: %s: peak buffer allocation failed, no peaks written\n", inFileName);
+        goto done;
+    }
+    
+    sprintf(peakFileName, "%s.peaks", inFileName);
+    
+    // Header and level table, with each level's bins following on from the previous level's.
+    
+    double sampleRate = (double) format.sampleRate;
+    UInt64 sampleRateBits;
+    UInt64 dataOffset = sizeof(PeakFileHeader) + sizeof(levelHeaders);
+    
+    memcpy(&sampleRateBits, &sampleRate, sizeof(sampleRateBits));
+    fileHeader.fileID          = CFSwapInt32(kPeakFileID);
+    fileHeader.version         = CFSwapInt16(kPeakFileVersion);
+    fileHeader.numChannels     = CFSwapInt16(numChannels);
+    fileHeader.numSampleFrames = CFSwapInt32(format.numSampleFrames);
+    fileHeader.numLevels       = CFSwapInt32(kPeakLevels);
+    fileHeader.sampleRate      = CFSwapInt64(sampleRateBits);
+    
+    for (int l = 0; l < kPeakLevels; l++) {
+        UInt32 numBins = (UInt32) (((UInt64) format.numSampleFrames + peakFramesPerBin[l] - 1) / peakFramesPerBin[l]);
+        levelHeaders[l].framesPerBin = CFSwapInt32(peakFramesPerBin[l]);
+        levelHeaders[l].numBins      = CFSwapInt32(numBins);
+        levelHeaders[l].dataOffset   = CFSwapInt64(dataOffset);
+        dataOffset += (UInt64) numBins * binBytes;
+    }
+    
+    if (!noWriteOpt) {
+        if ((peakFd = throttledOpen(peakFileName, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+            fprintf(stderr, "ERROR: %s: %s, can not create peak file\n", peakFileName, strerror(errno));
+            goto done;
+        }
+        
+        if (throttledWrite(peakFd, &fileHeader, sizeof(fileHeader)) != sizeof(fileHeader) ||
+            throttledWrite(peakFd, levelHeaders, sizeof(levelHeaders)) != sizeof(levelHeaders)) {
+            fprintf(stderr, "ERROR: %s: %s, peak file header write failed\n", peakFileName, strerror(errno));
+            goto done;
+        }
+    }
+    
+    for (UInt32 framesDone = 0; framesDone < format.numSampleFrames; ) {
+        
+        size_t n = format.numSampleFrames - framesDone;
+        if (n > kPeakBlockFrames) {
+            n = kPeakBlockFrames;
+        }
+        
+        ssize_t r = throttledPread(fd, readBuffer, n * bytesPerFrame, sampleDataOffset + (off_t) framesDone * bytesPerFrame);
+        
+        if (r != n * bytesPerFrame) {
+            fprintf(stderr, "ERROR: %s: sample data is truncated, expected %zu bytes at sample frame %u, read %zd, no peaks written\n",
+                    inFileName, n * bytesPerFrame, framesDone, r);
+            goto done;
+        }
+        
+        decodeSamples(readBuffer, n, &format, channels, 0);
+        
+        // Finest level from the samples, each coarser level from the level before it.
+        
+        size_t numBins = 0;
+        
+        for (int l = 0; l < kPeakLevels; l++) {
+            
+            size_t previousBins = numBins;
+            numBins = (n + peakFramesPerBin[l] - 1) / peakFramesPerBin[l];
+            
+            for (int c = 0; c < numChannels; c++) {
+                
+                float * mins = binMin[l] + c * maxBlockBins[l];
+                float * maxs = binMax[l] + c * maxBlockBins[l];
+                
+                for (size_t b = 0; b < numBins; b++) {
+                    
+                    if (l == 0) {
+                        size_t first = b * peakFramesPerBin[0];
+                        size_t count = n - first < peakFramesPerBin[0] ? n - first : peakFramesPerBin[0];
+                        minMaxSamples(channels[c] + first, count, &mins[b], &maxs[b]);
+                    }
+                    else {
+                        size_t ratio = peakFramesPerBin[l] / peakFramesPerBin[l - 1];
+                        size_t first = b * ratio;
+                        size_t count = previousBins - first < ratio ? previousBins - first : ratio;
+                        float lo, hi, unused;
+                        minMaxSamples(binMin[l - 1] + c * maxBlockBins[l - 1] + first, count, &lo, &unused);
+                        minMaxSamples(binMax[l - 1] + c * maxBlockBins[l - 1] + first, count, &unused, &hi);
+                        mins[b] = lo;
+                        maxs[b] = hi;
+                    }
+                }
+            }
+            
+            if (peakFd == -1) {
+                continue;
+            }
+            
+            // Interleave channels and write this block's bins at their place in the level.
+            
+            SInt16 * out = (SInt16 *) writeBuffer;
+            
+            for (size_t b = 0; b < numBins; b++) {
+                for (int c = 0; c < numChannels; c++) {
+                    *out++ = CFSwapInt16(peakValue(binMin[l][c * maxBlockBins[l] + b]));
+                    *out++ = CFSwapInt16(peakValue(binMax[l][c * maxBlockBins[l] + b]));
+                }
+            }
+            
+            off_t binOffset = CFSwapInt64(levelHeaders[l].dataOffset) + (off_t) (framesDone / peakFramesPerBin[l]) * binBytes;
+            
+            if (throttledPwrite(peakFd, writeBuffer, numBins * binBytes, binOffset) != numBins * binBytes) {
+                fprintf(stderr, "ERROR: %s: %s, peak file write failed\n", peakFileName, strerror(errno));
+                goto done;
+            }
+        }
+        
+        framesDone += (UInt32) n;
+    }
+    
+    ok = TRUE;
+    
+    if (verboseOpt) {
+        resultPrintf("%s\tpeaks\t%s\t%u", inFileName, noWriteOpt ? "(not written)" : peakFileName, peakFramesPerBin[0]);
+        for (int l = 1; l < kPeakLevels; l++) {
+            resultPrintf(",%u", peakFramesPerBin[l]);
+        }
+        resultPrintf("\n");
+    }
+    else {
+        resultPrintf("%s\tpeaks\t%s\n", inFileName, noWriteOpt ? "(not written)" : peakFileName);
+    }
+    
+done:
+    
+    if (peakFd != -1) {
+        close(peakFd);
+        if (!ok) {
+            unlink(peakFileName);
+        }
+    }
+    
+    for (int c = 0; c < numChannels && channels != NULL; c++) {
+        free(channels[c]);
+    }
+    
+    for (int l = 0; l < kPeakLevels; l++) {
+        free(binMin[l]);
+        free(binMax[l]);
+    }
+    
+    free(channels);
+    free(readBuffer);
+    free(writeBuffer);
+    free(peakFileName);
+    
+    return ok;
+}
+
+
+ssize_t copyBytes(int inFd, off_t inOffset, int outFd, off_t outOffset, size_t size) {
+    
+    // Copy size bytes between files, kCopyBufferSize at a time.
+    
+    size_t copied = 0;
+    UInt8 * buffer = malloc(kCopyBufferSize);
+    
+    if (buffer == NULL) {
+        return -1;
+    }
+    
+    while (copied < size) {
+        
+        size_t length = size - copied < kCopyBufferSize ? size - copied : kCopyBufferSize;
+        ssize_t ret = throttledPread(inFd, buffer, length, inOffset + copied);
+        
+        if (ret <= 0 || throttledPwrite(outFd, buffer, ret, outOffset + copied) != ret) {
+            free(buffer);
+            return -1;
+        }
+        copied += ret;
+    }
+    
+    free(buffer);
+    
+    return copied;
+}
+
+
+Boolean isPaddingChunk(int fd, const ChunkTableEntry * chunk) {
+    
+    OSType signature;
+    
+    if (chunk->ckID != ApplicationSpecificID || chunk->ckSize < sizeof(OSType)) {
+        return FALSE;
+    }
+    
+    if (cachedPread(fd, &signature, sizeof(signature), chunk->offset + sizeof(ChunkHeader)) != sizeof(signature)) {
+        return FALSE;
+    }
+    
+    return CFSwapInt32(signature) == kPaddingSignature;
+}
+
+
+TagChunk makeTextChunk(UInt32 ckID, const char * text) {
+    
+    // Build a complete NAME, AUTH, (c) , ANNO or COMT chunk. A COMT chunk gets a single comment stamped with the current time.
+    
+    TagChunk chunk = { NULL, 0, -1, 0 };
+    size_t textLength = strlen(text);
+    // A comment's text is padded to an even length inside the COMT chunk, other text chunks get the usual chunk pad byte.
+    size_t bodySize = ckID == CommentID ? sizeof(UInt16) + offsetof(Comment, text) + padOddSize(textLength) : textLength;
+    
+    chunk.size = sizeof(ChunkHeader) + padOddSize(bodySize);
+    
+    if ((chunk.bytes = calloc(1, chunk.size)) == NULL) {
+        fprintf(stderr, "ERROR: calloc() of %zu byte chunk failed\n", chunk.size);
+        exit(-1);
+    }
+    
+    ChunkHeaderPtr header = (ChunkHeaderPtr) chunk.bytes;
+    header->ckID = CFSwapInt32(ckID);
+    header->ckSize = CFSwapInt32((UInt32) bodySize);
+    
+    if (ckID == CommentID) {
+        
+        CommentsChunkPtr comments = (CommentsChunkPtr) chunk.bytes;
+        Comment * comment = comments->comments;
+        
+        comments->numComments = CFSwapInt16(1);
+        comment->timeStamp = CFSwapInt32((UInt32) (CFAbsoluteTimeGetCurrent() + kCFAbsoluteTimeIntervalSince1904));
+        comment->marker = 0;
+        comment->count = CFSwapInt16((UInt16) textLength);
+        memcpy(comment->text, text, textLength);
+    }
+    else {
+        memcpy(chunk.bytes + sizeof(ChunkHeader), text, textLength);
+    }
+    
+    return chunk;
+}
+
+
+Boolean placeTagChunks(TagSlot * slots, int numSlots, TagChunk * chunks, int numChunks) {
+    
+    // First fit, largest chunk first. Whatever is left of a slot becomes a padding chunk, so it must be
+    // nothing or at least kMinPaddingChunkSize bytes.
+    
+    for (int s = 0; s < numSlots; s++) {
+        slots[s].used = 0;
+    }
+    
+    for (int c = 0; c < numChunks; c++) {
+        chunks[c].slot = -1;
+    }
+    
+    for (int n = 0; n < numChunks; n++) {
+        
+        int largest = -1;
+        
+        for (int c = 0; c < numChunks; c++) {
+            if (chunks[c].slot == -1 && (largest == -1 || chunks[c].size > chunks[largest].size)) {
+                largest = c;
+            }
+        }
+        
+        for (int s = 0; s < numSlots && chunks[largest].slot == -1; s++) {
+            
+            off_t left = slots[s].size - slots[s].used;
+            
+            if (left == chunks[largest].size || left >= chunks[largest].size + kMinPaddingChunkSize) {
+                chunks[largest].slot = s;
+                chunks[largest].offset = slots[s].used;
+                slots[s].used += chunks[largest].size;
+            }
+        }
+        
+        if (chunks[largest].slot == -1) {
+            return FALSE;
+        }
+    }
+    
+    for (int s = 0; s < numSlots; s++) {
+        
+        off_t left = slots[s].size - slots[s].used;
+        
+        if (left != 0 && left < kMinPaddingChunkSize) {
+            return FALSE;
+        }
+    }
+    
+    return TRUE;
+}
+
+
+Boolean writeTagSlot(int fd, const TagSlot * slot, int slotIndex, const TagChunk * chunks, int numChunks) {
+    
+    // Write the chunks placed in a slot followed by a padding chunk for the rest. The padding is zeroed,
+    // old text should not linger in the file.
+    
+    UInt8 * buffer = calloc(1, slot->size);
+    
+    if (buffer == NULL) {
+        fprintf(stderr, "ERROR: calloc() of %lld byte slot failed\n", (long long) slot->size);
+        exit(-1);
+    }
+    
+    for (int c = 0; c < numChunks; c++) {
+        if (chunks[c].slot == slotIndex) {
+            memcpy(buffer + chunks[c].offset, chunks[c].bytes, chunks[c].size);
+        }
+    }
+    
+    if (slot->used < slot->size) {
+        
+        ApplicationSpecificChunkPtr padding = (ApplicationSpecificChunkPtr) (buffer + slot->used);
+        
+        padding->ckID = CFSwapInt32(ApplicationSpecificID);
+        padding->ckSize = CFSwapInt32((UInt32) (slot->size - slot->used - sizeof(ChunkHeader)));
+        padding->applicationSignature = CFSwapInt32(kPaddingSignature);
+    }
+    
+    Boolean ok = throttledPwrite(fd, buffer, slot->size, slot->offset) == slot->size;
+    
+    free(buffer);
+    
+    return ok;
+}
+
+
+Boolean rewriteTaggedFile(int fd, const char * inFileName, const struct stat * sb, const Boolean * isFree, TagChunk * chunks, int numChunks) {
+    
+    // Copy the file without the replaced chunks to a temporary file, with the new chunks and a padding chunk
+    // ahead of SSND, then rename it over the original. Anything after the FORM is copied through unchanged and
+    // the original's owner, permissions, ACLs and extended attributes are copied with fcopyfile().
+    
+    char * tempName;
+    int outFd;
+    off_t outOffset = sizeof(ContainerChunk);
+    off_t formEnd = sizeof(ChunkHeader) + (off_t) formChunkSize;
+    Boolean insertedNew = FALSE;
+    
+    asprintf(&tempName, "%s.affix-tag", inFileName);
+    
+    if ((outFd = throttledOpen(tempName, O_RDWR | O_CREAT | O_TRUNC, sb->st_mode & 0777)) == -1) {
+        fprintf(stderr, "ERROR: %s: %s, can not create temporary file\n", tempName, strerror(errno));
+        free(tempName);
+        return FALSE;
+    }
+    
+    for (int c = 0; c <= numChunkTableEntries; c++) {
+        
+        Boolean atEnd = c == numChunkTableEntries;
+        
+        if (!insertedNew && (atEnd || chunkTable[c].ckID == SoundDataID)) {
+            
+            for (int n = 0; n < numChunks; n++) {
+                if (throttledPwrite(outFd, chunks[n].bytes, chunks[n].size, outOffset) != chunks[n].size) {
+                    goto writeError;
+                }
+                outOffset += chunks[n].size;
+            }
+            
+            TagSlot padding = { outOffset, kTagPaddingReserve, 0 };
+            
+            if (!writeTagSlot(outFd, &padding, -1, chunks, 0)) {
+                goto writeError;
+            }
+            
+            outOffset += kTagPaddingReserve;
+            insertedNew = TRUE;
+        }
+        
+        if (atEnd) {
+            break;
+        }
+        
+        if (isFree[c]) {
+            continue;
+        }
+        
+        size_t size = sizeof(ChunkHeader) + padOddSize(chunkTable[c].ckSize);
+        
+        if (copyBytes(fd, chunkTable[c].offset, outFd, outOffset, size) != size) {
+            goto writeError;
+        }
+        outOffset += size;
+    }
+    
+    if (outOffset - sizeof(ChunkHeader) > UINT32_MAX) {
+        fprintf(stderr, "%s: tagged file would be too large for AIFF, not changed\n", inFileName);
+        close(outFd);
+        unlink(tempName);
+        free(tempName);
+        return FALSE;
+    }
+    
+    ContainerChunk form;
+    
+    form.ckID = CFSwapInt32(FORMID);
+    form.ckSize = CFSwapInt32((UInt32) (outOffset - sizeof(ChunkHeader)));
+    form.formType = CFSwapInt32(aiffIsCompressed ? AIFCID : AIFFID);
+    
+    if (throttledPwrite(outFd, &form, sizeof(form), 0) != sizeof(form)) {
+        goto writeError;
+    }
+    
+    if (sb->st_size > formEnd &&
+        copyBytes(fd, formEnd, outFd, outOffset, sb->st_size - formEnd) != sb->st_size - formEnd) {
+        goto writeError;
+    }
+    
+    if (fcopyfile(fd, outFd, NULL, COPYFILE_METADATA) == -1) {
+        fprintf(stderr, "%s: %s, owner, permissions or extended attributes not copied, file not changed\n", inFileName, strerror(errno));
+        close(outFd);
+        unlink(tempName);
+        free(tempName);
+        return FALSE;
+    }
+    
+    if (fsync(outFd) == -1) {
+        goto writeError;
+    }
+    
+    close(outFd);
+    
+    if (rename(tempName, inFileName) == -1) {
+        fprintf(stderr, "ERROR: %s: %s, can not replace with %s\n", inFileName, strerror(errno), tempName);
+        unlink(tempName);
+        free(tempName);
+        return FALSE;
+    }
+    
+    free(tempName);
+    
+    return TRUE;
+    
+writeError:
+    
+    fprintf(stderr, "ERROR: %s: %s, write failed, file not changed\n", tempName, strerror(errno));
+    close(outFd);
+    unlink(tempName);
+    free(tempName);
+    
+    return FALSE;
+}
+
+
+int tagFile(const char * inFileName, const TagEdit * edits, int numEdits) {
+    
+    struct stat sb;
+    int fd;
+    TagChunk chunks[kMaxTagEdits];
+    int numChunks = 0;
+    TagSlot * slots;
+    int numSlots = 0;
+    Boolean * isFree;
+    const char * how;
+    int ret = -1;
+    
+    fileName = (char *) inFileName;
+    
+    if ((fd = throttledOpen(inFileName, noWriteOpt ? O_RDONLY : O_RDWR, 0)) == -1) {
+        fprintf(stderr, "ERROR: %s: %s, skipping file\n", inFileName, strerror(errno));
+        return -1;
+    }
+    
+    if (!readChunkTable(fd) || fstat(fd, &sb) == -1) {
+        fprintf(stderr, "%s: not tagged\n", inFileName);
+        close(fd);
+        return -1;
+    }
+    
+    // The chunks being replaced and any padding chunks are free space, runs of adjacent ones make one slot.
+    
+    slots = calloc(numChunkTableEntries + 1, sizeof(TagSlot));
+    isFree = calloc(numChunkTableEntries, sizeof(Boolean));
+    
+    for (int c = 0; c < numChunkTableEntries; c++) {
+        
+        for (int e = 0; e < numEdits; e++) {
+            if (chunkTable[c].ckID == edits[e].ckID) {
+                isFree[c] = TRUE;
+            }
+        }
+        
+        if (!isFree[c] && !isPaddingChunk(fd, &chunkTable[c])) {
+            continue;
+        }
+        
+        isFree[c] = TRUE;
+        
+        off_t size = sizeof(ChunkHeader) + padOddSize(chunkTable[c].ckSize);
+        
+        if (c > 0 && isFree[c - 1]) {
+            slots[numSlots - 1].size += size;
+        }
+        else {
+            slots[numSlots].offset = chunkTable[c].offset;
+            slots[numSlots].size = size;
+            numSlots++;
+        }
+    }
+    
+    forgetHeaderCache();
+    
+    for (int e = 0; e < numEdits; e++) {
+        if (edits[e].text[0] != '\0') {
+            chunks[numChunks++] = makeTextChunk(edits[e].ckID, edits[e].text);
+        }
+    }
+    
+    off_t formEnd = sizeof(ChunkHeader) + (off_t) formChunkSize;
+    off_t appendSize = kTagPaddingReserve;
+    
+    for (int n = 0; n < numChunks; n++) {
+        appendSize += chunks[n].size;
+    }
+    
+    Boolean inPlace = placeTagChunks(slots, numSlots, chunks, numChunks);
+    Boolean append = FALSE;
+    
+    if (!inPlace && sb.st_size == formEnd && formEnd + appendSize - sizeof(ChunkHeader) <= UINT32_MAX) {
+        slots[numSlots].offset = formEnd;
+        slots[numSlots].size = appendSize;
+        append = placeTagChunks(slots, numSlots + 1, chunks, numChunks);
+    }
+    
+    if (inPlace) {
+        
+        how = "in place";
+        
+        if (!noWriteOpt) {
+            for (int s = 0; s < numSlots; s++) {
+                if (!writeTagSlot(fd, &slots[s], s, chunks, numChunks)) {
+                    goto writeError;
+                }
+            }
+        }
+    }
+    else if (append) {
+        
+        // Append after the last chunk and grow the FORM to cover it before the old chunks are turned into padding,
+        // so the file always has either the old or the new text.
+        
+        how = "appended";
+        
+        if (!noWriteOpt) {
+            
+            UInt32 newFormSize = CFSwapInt32((UInt32) (formEnd + appendSize - sizeof(ChunkHeader)));
+            
+            if (!writeTagSlot(fd, &slots[numSlots], numSlots, chunks, numChunks) ||
+                throttledPwrite(fd, &newFormSize, sizeof(newFormSize), offsetof(ContainerChunk, ckSize)) != sizeof(newFormSize)) {
+                goto writeError;
+            }
+            
+            for (int s = 0; s < numSlots; s++) {
+                if (!writeTagSlot(fd, &slots[s], s, chunks, numChunks)) {
+                    goto writeError;
+                }
+            }
+        }
+    }
+    else {
+        
+        how = "rewritten";
+        
+        fprintf(stderr, "WARNING: %s: no room for the tags in place or at the end, copying the whole file\n", inFileName);
+        
+        if (!noWriteOpt && !rewriteTaggedFile(fd, inFileName, &sb, isFree, chunks, numChunks)) {
+            goto done;
+        }
+    }
+    
+    printf("%s\ttagged\t%s%s\n", inFileName, how, noWriteOpt ? " (not written)" : "");
+    ret = 0;
+    goto done;
+    
+writeError:
+    
+    fprintf(stderr, "ERROR: %s: %s, write failed, tags may be partly written\n", inFileName, strerror(errno));
+    
+done:
+    
+    for (int n = 0; n < numChunks; n++) {
+        free(chunks[n].bytes);
+    }
+    free(slots);
+    free(isFree);
+    close(fd);
+    
+    return ret;
+}
+
+
+int tagCommand(int argc, const char * argv[]) {
+    
+    // affix tag [-n] [-N name] [-A author] [-R copyright] [-m comment] [-a annotation] aiff_file1 ... aiff_filen
+    
+    TagEdit edits[kMaxTagEdits];
+    int numEdits = 0;
+    int failures = 0;
+    int c;
+    
+    while ((c = getopt(argc, (char * const *) argv, "dnN:A:R:m:a:h")) != -1) {
+        
+        UInt32 ckID = 0;
+        
+        switch (c) {
+            case 'd':
+                debugOpt = TRUE;
+                break;
+            case 'n':
+                noWriteOpt = TRUE;
+                break;
+            case 'N':
+                ckID = NameID;
+                break;
+            case 'A':
+                ckID = AuthorID;
+                break;
+            case 'R':
+                ckID = CopyrightID;
+                break;
+            case 'm':
+                ckID = CommentID;
+                break;
+            case 'a':
+                ckID = AnnotationID;
+                break;
+            default:
+                usage(programName);
+                return 1;
+        }
+        
+        if (ckID == 0) {
+            continue;
+        }
+        
+        if (strlen(optarg) > (ckID == CommentID ? UINT16_MAX : INT32_MAX - 16)) {
+            fprintf(stderr, "ERROR: -%c text is too long\n", c);
+            return -1;
+        }
+        
+        for (int e = 0; e < numEdits; e++) {
+            if (edits[e].ckID == ckID) {
+                fprintf(stderr, "ERROR: -%c given more than once\n", c);
+                return -1;
+            }
+        }
+        
+        edits[numEdits].ckID = ckID;
+        edits[numEdits].text = optarg;
+        numEdits++;
+    }
+    
+    if (numEdits == 0 || optind == argc) {
+        fprintf(stderr, "usage: affix tag [-n] [-N name] [-A author] [-R copyright] [-m comment] [-a annotation] aiff_file1 ... aiff_filen\n");
+        return 1;
+    }
+    
+    for (int i = optind; i < argc; i++) {
+        if (tagFile(argv[i], edits, numEdits) != 0) {
+            failures++;
+        }
+    }
+    
+    return failures ? 1 : 0;
+}
+
+
+Boolean openSpliceSource(const char * inFileName, SpliceSource * source) {
+    
+    struct stat sb;
+    
+    memset(source, 0, sizeof(SpliceSource));
+    source->fileName = inFileName;
+    fileName = (char *) inFileName;
+    
+    if ((source->fd = throttledOpen(inFileName, O_RDONLY, 0)) == -1) {
+        fprintf(stderr, "ERROR: %s: %s, not readable\n", inFileName, strerror(errno));
+        return FALSE;
+    }
+    
+    resetChunkWalk();
+    getFORMChunk(source->fd, chunkHeaderPtr);
+    
+    while (!invalidFile && getChunks(source->fd, chunkHeaderPtr)) {
+    }
+    
+    forgetHeaderCache();
+    
+    if (invalidFile || commChunkCount != 1 || soundDataChunkOffset == 0) {
+        fprintf(stderr, "%s: not a valid AIFF/AIFF-C file with sample data\n", inFileName);
+        goto fail;
+    }
+    
+    // Frames can only be cut and joined without decoding when every frame is the same number of bytes.
+    
+    UInt32 bytesPerFrame;
+    
+    if (!soundDataBytesPerFrame(&bytesPerFrame)) {
+        fprintf(stderr, "%s: compression type \'%s\' sample data can not be spliced without decoding\n",
+                inFileName, stringFromUInt32(savedCommonChunkPtr->compressionType));
+        goto fail;
+    }
+    
+    getSampleFormat(savedCommonChunkPtr, aiffIsCompressed, &source->format);
+    source->format.bytesPerSample = bytesPerFrame / source->format.numChannels;
+    source->isCompressed = aiffIsCompressed;
+    source->sampleDataOffset = soundDataChunkOffset + sizeof(SoundDataChunk) + CFSwapInt32(savedSoundDataChunk.offset);
+    
+    off_t dataEnd = source->sampleDataOffset + (off_t) source->format.numSampleFrames * bytesPerFrame;
+    
+    if (fstat(source->fd, &sb) == -1 || dataEnd > sb.st_size ||
+        dataEnd > soundDataChunkOffset + sizeof(ChunkHeader) + (off_t) CFSwapInt32(savedSoundDataChunk.ckSize)) {
+        fprintf(stderr, "%s: \'SSND\' chunk does not hold the sample frames \'COMM\' claims, run affix -x for details\n", inFileName);
+        goto fail;
+    }
+    
+    if ((source->commonChunkPtr = malloc(maxChunkSize)) == NULL) {
+        fprintf(stderr, "ERROR: malloc() of COMM chunk copy failed\n");
+        goto fail;
+    }
+    
+    memcpy(source->commonChunkPtr, savedCommonChunkPtr, maxChunkSize);
+    
+    return TRUE;
+    
+fail:
+    
+    close(source->fd);
+    source->fd = -1;
+    
+    return FALSE;
+}
+
+
+void closeSpliceSource(SpliceSource * source) {
+    
+    if (source->fd != -1) {
+        close(source->fd);
+    }
+    free(source->commonChunkPtr);
+}
+
+
+Boolean parseFramePosition(const char * string, const SpliceSource * source, UInt32 * frame) {
+    
+    // A sample frame number, or seconds when followed by s, e.g. 441000 or 10s, rounded to the nearest frame.
+    
+    char * end;
+    long double position = strtold(string, &end);
+    
+    if (end != string && *end == 's' && end[1] == '\0') {
+        position = roundl(position * source->format.sampleRate);
+    }
+    else if (end == string || *end != '\0' || position != floorl(position)) {
+        fprintf(stderr, "ERROR: %s: position must be a whole number of sample frames or seconds followed by s\n", string);
+        return FALSE;
+    }
+    
+    if (position < 0 || position > source->format.numSampleFrames) {
+        fprintf(stderr, "ERROR: %s: position is outside %s, which has %u sample frames\n",
+                string, source->fileName, source->format.numSampleFrames);
+        return FALSE;
+    }
+    
+    *frame = (UInt32) position;
+    
+    return TRUE;
+}
+
+
+Boolean cloneSpliceFile(const char * outFileName, const SpliceSegment * segment) {
+    
+    // Clone the source and cut the clone down to the segment's frames by rewriting its headers in place. Returns FALSE,
+    // with nothing left behind, when the volume can't clone or the source's chunks don't allow it, and the caller copies.
+    // Only possible when SSND is the last chunk, everything after the frames is cut off with ftruncate().
+    
+    const SpliceSource * source = segment->source;
+    UInt32 bytesPerFrame = source->format.numChannels * source->format.bytesPerSample;
+    int soundDataIndex = -1;
+    int commonIndex = -1;
+    char * tempName;
+    int fd;
+    
+    asprintf(&tempName, "%s.affix-tmp", outFileName);
+    unlink(tempName);
+    
+    if (clonefile(source->fileName, tempName, 0) == -1) {
+        free(tempName);
+        return FALSE;
+    }
+    
+    if ((fd = throttledOpen(tempName, O_RDWR, 0)) == -1 || !readChunkTable(fd)) {
+        goto fail;
+    }
+    
+    for (int c = 0; c < numChunkTableEntries; c++) {
+        
+        if (chunkTable[c].ckID == SoundDataID) {
+            soundDataIndex = c;
+        }
+        else if (chunkTable[c].ckID == CommonID) {
+            commonIndex = c;
+        }
+        else if (chunkTable[c].ckID != FormatVersionID && sizeof(ChunkHeader) + chunkTable[c].ckSize < kMinPaddingChunkSize) {
+            goto fail;      // too small to become a padding chunk
+        }
+    }
+    
+    if (soundDataIndex != numChunkTableEntries - 1 || commonIndex == -1) {
+        goto fail;
+    }
+    
+    off_t soundDataOffset = chunkTable[soundDataIndex].offset;
+    off_t firstByte = (off_t) segment->firstFrame * bytesPerFrame;
+    off_t dataEnd = source->sampleDataOffset + firstByte + (off_t) segment->numFrames * bytesPerFrame;
+    off_t ssndOffset = source->sampleDataOffset - soundDataOffset - sizeof(SoundDataChunk) + firstByte;
+    off_t ssndSize = dataEnd - soundDataOffset - sizeof(ChunkHeader);
+    off_t fileEnd = dataEnd + ssndSize % 2;
+    
+    if (ssndOffset > UINT32_MAX || ssndSize > UINT32_MAX) {
+        goto fail;
+    }
+    
+    // Markers, text and anything else would describe the whole source, they become zeroed padding chunks.
+    
+    for (int c = 0; c < numChunkTableEntries; c++) {
+        
+        UInt32 ckID = chunkTable[c].ckID;
+        
+        if (ckID != FormatVersionID && ckID != CommonID && ckID != SoundDataID) {
+            
+            TagSlot slot = { chunkTable[c].offset, sizeof(ChunkHeader) + padOddSize(chunkTable[c].ckSize), 0 };
+            
+            if (!writeTagSlot(fd, &slot, 0, NULL, 0)) {
+                goto fail;
+            }
+        }
+    }
+    
+    UInt32 numSampleFrames = CFSwapInt32(segment->numFrames);
+    UInt32 offset = CFSwapInt32((UInt32) ssndOffset);
+    UInt32 ckSize = CFSwapInt32((UInt32) ssndSize);
+    UInt32 formSize = CFSwapInt32((UInt32) (fileEnd - sizeof(ChunkHeader)));
+    UInt8 pad = 0;
+    
+    if (throttledPwrite(fd, &numSampleFrames, sizeof(UInt32),
+                        chunkTable[commonIndex].offset + offsetof(CommonChunk, numSampleFrames)) != sizeof(UInt32) ||
+        throttledPwrite(fd, &offset, sizeof(UInt32), soundDataOffset + offsetof(SoundDataChunk, offset)) != sizeof(UInt32) ||
+        throttledPwrite(fd, &ckSize, sizeof(UInt32), soundDataOffset + offsetof(SoundDataChunk, ckSize)) != sizeof(UInt32) ||
+        throttledPwrite(fd, &formSize, sizeof(UInt32), offsetof(ContainerChunk, ckSize)) != sizeof(UInt32) ||
+        ftruncate(fd, fileEnd) == -1 ||
+        (fileEnd > dataEnd && throttledPwrite(fd, &pad, sizeof(pad), dataEnd) != sizeof(pad))) {
+        fprintf(stderr, "ERROR: %s: %s, write failed\n", tempName, strerror(errno));
+        goto fail;
+    }
+    
+    if (fsync(fd) == -1 || close(fd) == -1) {
+        fprintf(stderr, "ERROR: %s: %s, write failed\n", tempName, strerror(errno));
+        fd = -1;
+        goto fail;
+    }
+    fd = -1;
+    
+    if (rename(tempName, outFileName) == -1) {
+        fprintf(stderr, "ERROR: %s: %s, can not rename %s\n", outFileName, strerror(errno), tempName);
+        goto fail;
+    }
+    
+    printf("%s\t%u frames\tcloned\n", outFileName, segment->numFrames);
+    free(tempName);
+    
+    return TRUE;
+    
+fail:
+    
+    if (fd != -1) {
+        close(fd);
+    }
+    unlink(tempName);
+    free(tempName);
+    
+    return FALSE;
+}
+
+
+Boolean writeSpliceFile(const char * outFileName, const SpliceSegment * segments, int numSegments, Boolean tryClone) {
+    
+    // Write the sample frames of segments, in order, to a new file with the format of the first segment's source.
+    // Written to a temporary file then renamed, so outFileName can also be one of the inputs. With tryClone a single
+    // segment is cloned from its source if possible.
+    
+    const SpliceSource * first = segments[0].source;
+    UInt32 bytesPerFrame = first->format.numChannels * first->format.bytesPerSample;
+    UInt64 numFrames = 0;
+    char * tempName;
+    int outFd;
+    
+    for (int n = 0; n < numSegments; n++) {
+        numFrames += segments[n].numFrames;
+    }
+    
+    if (numFrames > UINT32_MAX) {
+        fprintf(stderr, "ERROR: %s: %llu sample frames is too many for an AIFF/AIFF-C file\n", outFileName, numFrames);
+        return FALSE;
+    }
+    
+    if (noWriteOpt) {
+        printf("%s\t%llu frames\t(not written)\n", outFileName, numFrames);
+        return TRUE;
+    }
+    
+    if (tryClone && numSegments == 1 && cloneSpliceFile(outFileName, &segments[0])) {
+        return TRUE;
+    }
+    
+    off_t headerSize = sizeof(ContainerChunk) + (first->isCompressed ? sizeof(FormatVersionChunk) : 0) +
+                       sizeof(ChunkHeader) + padOddSize(CFSwapInt32(first->commonChunkPtr->ckSize)) + sizeof(SoundDataChunk);
+    
+    asprintf(&tempName, "%s.affix-tmp", outFileName);
+    
+    if ((outFd = throttledOpen(tempName, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        fprintf(stderr, "ERROR: %s: %s, can not create file\n", tempName, strerror(errno));
+        free(tempName);
+        return FALSE;
+    }
+    
+    if (writeAIFFHeader(outFd, first->commonChunkPtr, first->isCompressed, &first->format, (UInt32) numFrames,
+                        first->format.sampleRate, 0, 0) == -1) {
+        goto fail;
+    }
+    
+    off_t outOffset = headerSize;
+    
+    for (int n = 0; n < numSegments; n++) {
+        
+        size_t size = (size_t) segments[n].numFrames * bytesPerFrame;
+        off_t inOffset = segments[n].source->sampleDataOffset + (off_t) segments[n].firstFrame * bytesPerFrame;
+        
+        if (copyBytes(segments[n].source->fd, inOffset, outFd, outOffset, size) != size) {
+            fprintf(stderr, "ERROR: %s: %s, copy from %s failed\n", tempName, strerror(errno), segments[n].source->fileName);
+            goto fail;
+        }
+        outOffset += size;
+    }
+    
+    // SSND ckSize (offset and blockSize fields and the frames) is odd when the frames are, the chunk gets its pad byte.
+    
+    if ((outOffset - headerSize) % 2) {
+        
+        UInt8 pad = 0;
+        
+        if (throttledPwrite(outFd, &pad, sizeof(pad), outOffset) != sizeof(pad)) {
+            goto fail;
+        }
+    }
+    
+    if (fsync(outFd) == -1 || close(outFd) == -1) {
+        fprintf(stderr, "ERROR: %s: %s, write failed\n", tempName, strerror(errno));
+        unlink(tempName);
+        free(tempName);
+        return FALSE;
+    }
+    
+    if (rename(tempName, outFileName) == -1) {
+        fprintf(stderr, "ERROR: %s: %s, can not rename %s\n", outFileName, strerror(errno), tempName);
+        unlink(tempName);
+        free(tempName);
+        return FALSE;
+    }
+    
+    printf("%s\t%llu frames\tcopied\n", outFileName, numFrames);
+    free(tempName);
+    
+    return TRUE;
+    
+fail:
+    
+    close(outFd);
+    unlink(tempName);
+    free(tempName);
+    
+    return FALSE;
+}
+
+
+int spliceCommand(int argc, const char * argv[]) {
+    
+    // affix split [-n] aiff_file position1 ... positionn
+    // affix trim [-n] -o out_file aiff_file start end
+    // affix concat [-n] -o out_file aiff_file1 ... aiff_filen
+    
+    const char * command = argv[0];
+    const char * outFileName = NULL;
+    SpliceSource * sources;
+    SpliceSegment * segments;
+    int numSources = 0;
+    int numSegments = 0;
+    int ret = 1;
+    int c;
+    
+    while ((c = getopt(argc, (char * const *) argv, "dno:h")) != -1) {
+        switch (c) {
+            case 'd':
+                debugOpt = TRUE;
+                break;
+            case 'n':
+                noWriteOpt = TRUE;
+                break;
+            case 'o':
+                outFileName = optarg;
+                break;
+            default:
+                usage(programName);
+                return 1;
+        }
+    }
+    
+    argc -= optind;
+    argv += optind;
+    
+    if ((strcmp(command, "split") == 0 && (argc < 2 || outFileName != NULL || argc > kMaxSpliceSegments)) ||
+        (strcmp(command, "trim") == 0 && (argc != 3 || outFileName == NULL)) ||
+        (strcmp(command, "concat") == 0 && (argc < 1 || outFileName == NULL || argc > kMaxSpliceSegments))) {
+        fprintf(stderr, "usage: affix split [-n] aiff_file position1 ... positionn\n"
+                        "       affix trim [-n] -o out_file aiff_file start end\n"
+                        "       affix concat [-n] -o out_file aiff_file1 ... aiff_filen\n"
+                        "positions are sample frame numbers, or seconds followed by s, e.g. 10.5s\n");
+        return 1;
+    }
+    
+    sources = calloc(argc, sizeof(SpliceSource));
+    segments = calloc(argc, sizeof(SpliceSegment));
+    
+    if (strcmp(command, "concat") == 0) {
+        
+        // Every input must have the same sample format as the first, only the number of frames can differ.
+        
+        for (int i = 0; i < argc; i++) {
+            
+            SpliceSource * source = &sources[numSources];
+            
+            if (!openSpliceSource(argv[i], source)) {
+                goto done;
+            }
+            numSources++;
+            
+            if (source->isCompressed != sources[0].isCompressed ||
+                source->format.numChannels != sources[0].format.numChannels ||
+                source->format.sampleSize != sources[0].format.sampleSize ||
+                source->format.sampleRate != sources[0].format.sampleRate ||
+                (source->isCompressed && source->commonChunkPtr->compressionType != sources[0].commonChunkPtr->compressionType)) {
+                fprintf(stderr, "%s: \'COMM\' sample format does not match %s, not concatenated\n", argv[i], argv[0]);
+                goto done;
+            }
+            
+            segments[numSegments].source = source;
+            segments[numSegments].firstFrame = 0;
+            segments[numSegments].numFrames = source->format.numSampleFrames;
+            numSegments++;
+        }
+        
+        ret = writeSpliceFile(outFileName, segments, numSegments, FALSE) ? 0 : 1;
+    }
+    else {
+        
+        UInt32 positions[kMaxSpliceSegments + 1];
+        int numPositions = 0;
+        
+        if (!openSpliceSource(argv[0], &sources[0])) {
+            goto done;
+        }
+        numSources++;
+        
+        positions[numPositions++] = 0;
+        
+        for (int i = 1; i < argc; i++) {
+            
+            if (!parseFramePosition(argv[i], &sources[0], &positions[numPositions])) {
+                goto done;
+            }
+            
+            if (positions[numPositions] < positions[numPositions - 1] ||
+                (strcmp(command, "split") == 0 && positions[numPositions] == positions[numPositions - 1])) {
+                fprintf(stderr, "ERROR: %s: positions must be in increasing order\n", argv[i]);
+                goto done;
+            }
+            numPositions++;
+        }
+        
+        if (strcmp(command, "trim") == 0) {
+            
+            segments[0].source = &sources[0];
+            segments[0].firstFrame = positions[1];
+            segments[0].numFrames = positions[2] - positions[1];
+            
+            ret = writeSpliceFile(outFileName, segments, 1, TRUE) ? 0 : 1;
+        }
+        else {
+            
+            // split at each position, aiff_file-1.aif up to the first position and so on.
+            
+            positions[numPositions++] = sources[0].format.numSampleFrames;
+            ret = 0;
+            
+            for (int p = 0; p + 1 < numPositions; p++) {
+                
+                if (positions[p + 1] == positions[p]) {
+                    continue;       // split at the very end
+                }
+                
+                char * partFileName = numberedFileName(argv[0], p + 1);
+                
+                segments[0].source = &sources[0];
+                segments[0].firstFrame = positions[p];
+                segments[0].numFrames = positions[p + 1] - positions[p];
+                
+                if (!writeSpliceFile(partFileName, segments, 1, TRUE)) {
+                    ret = 1;
+                }
+                free(partFileName);
+            }
+        }
+    }
+    
+done:
+    
+    for (int s = 0; s < numSources; s++) {
+        closeSpliceSource(&sources[s]);
+    }
+    free(sources);
+    free(segments);
+    
+    return ret;
+}
+
+
+void addCatalogRow(const char * rowFileName) {
+    
+    // Add the file just parsed to the catalog being built.
+    
+    size_t nameSize = strlen(rowFileName) + 1;
+    
+    if (catalogRows == catalogCapacity) {
+        
+        catalogCapacity = catalogCapacity == 0 ? 1024 : 2 * catalogCapacity;
+        
+        for (int column = 0; column < kCatalogColumns; column++) {
+            if ((catalogData[column] = realloc(catalogData[column], catalogCapacity * catalogColumnWidths[column])) == NULL) {
+                fprintf(stderr, "ERROR: out of memory building catalog\n");
+                exit(-1);
+            }
+        }
+        
+        if ((catalogNameOffsets = realloc(catalogNameOffsets, catalogCapacity * sizeof(UInt64))) == NULL) {
+            fprintf(stderr, "ERROR: out of memory building catalog\n");
+            exit(-1);
+        }
+    }
+    
+    if (catalogNameHeapSize + nameSize > catalogNameHeapCapacity) {
+        
+        catalogNameHeapCapacity = 2 * (catalogNameHeapSize + nameSize) + 65536;
+        
+        if ((catalogNameHeap = realloc(catalogNameHeap, catalogNameHeapCapacity)) == NULL) {
+            fprintf(stderr, "ERROR: out of memory building catalog\n");
+            exit(-1);
+        }
+    }
+    
+    long double rate;
+    x80told(&savedCommonChunkPtr->sampleRate, &rate);
+    
+    ((UInt16 *) catalogData[kColumnNumChannels])[catalogRows]     = CFSwapInt16(savedCommonChunkPtr->numChannels);
+    ((UInt32 *) catalogData[kColumnNumSampleFrames])[catalogRows] = CFSwapInt32(savedCommonChunkPtr->numSampleFrames);
+    ((UInt16 *) catalogData[kColumnSampleSize])[catalogRows]      = CFSwapInt16(savedCommonChunkPtr->sampleSize);
+    ((double *) catalogData[kColumnSampleRate])[catalogRows]      = (double) rate;
+    ((UInt32 *) catalogData[kColumnFormType])[catalogRows]        = aiffIsCompressed ? AIFCID : AIFFID;
+    ((UInt32 *) catalogData[kColumnCompressionType])[catalogRows] = aiffIsCompressed ? CFSwapInt32(savedCommonChunkPtr->compressionType) : NoneType;
+    
+    catalogNameOffsets[catalogRows] = catalogNameHeapSize;
+    memcpy(catalogNameHeap + catalogNameHeapSize, rowFileName, nameSize);
+    catalogNameHeapSize += nameSize;
+    catalogRows++;
+}
+
+
+void writeCatalogFile(const char * catalogName) {
+    
+    // Written to a temporary file then renamed, so a query never sees a half written catalog.
+    
+    CatalogHeader header;
+    UInt64 offset = sizeof(CatalogHeader);
+    char * tempName = malloc(strlen(catalogName) + sizeof(".tmp"));
+    FILE * file;
+    static const UInt8 zeros[8] = { 0 };
+    
+    memset(&header, 0, sizeof(header));
+    header.fileID  = kCatalogFileID;
+    header.version = kCatalogVersion;
+    header.numRows = catalogRows;
+    
+    for (int column = 0; column < kCatalogColumns; column++) {
+        header.columnOffsets[column] = offset;
+        offset += (catalogRows * catalogColumnWidths[column] + 7) & ~7ULL;
+    }
+    
+    header.nameOffsetsOffset = offset;
+    offset += catalogRows * sizeof(UInt64);
+    header.nameHeapOffset = offset;
+    header.nameHeapSize = catalogNameHeapSize;
+    
+    sprintf(tempName, "%s.tmp", catalogName);
+    
+    if ((file = fopen(tempName, "w")) == NULL) {
+        fprintf(stderr, "ERROR: %s: %s, can not create catalog file\n", tempName, strerror(errno));
+        exit(-1);
+    }
+    
+    fwrite(&header, sizeof(header), 1, file);
+    
+    for (int column = 0; column < kCatalogColumns; column++) {
+        size_t size = catalogRows * catalogColumnWidths[column];
+        fwrite(catalogData[column], 1, size, file);
+        fwrite(zeros, 1, ((size + 7) & ~7ULL) - size, file);
+    }
+    
+    fwrite(catalogNameOffsets, sizeof(UInt64), catalogRows, file);
+    fwrite(catalogNameHeap, 1, catalogNameHeapSize, file);
+    
+    if (ferror(file) || fclose(file) != 0 || rename(tempName, catalogName) == -1) {
+        fprintf(stderr, "ERROR: %s: %s, catalog file write failed\n", catalogName, strerror(errno));
+        unlink(tempName);
+        exit(-1);
+    }
+    
+    if (verboseOpt) {
+        fprintf(stderr, "%s: catalog of %zu files written\n", catalogName, catalogRows);
+    }
+    
+    free(tempName);
+}
+
+
+void mapCatalogFile(const char * catalogName) {
+    
+    // Map a catalog file and point the catalog columns into it.
+    
+    struct stat sb;
+    int fd;
+    UInt8 * base;
+    CatalogHeader * header;
+    
+    if ((fd = throttledOpen(catalogName, O_RDONLY, 0)) == -1 || fstat(fd, &sb) == -1) {
+        fprintf(stderr, "ERROR: %s: %s, can not read catalog file\n", catalogName, strerror(errno));
+        exit(-1);
+    }
+    
+    if (sb.st_size < sizeof(CatalogHeader) ||
+        (base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "ERROR: %s is not an affix catalog file\n", catalogName);
+        exit(-1);
+    }
+    
+    close(fd);
+    header = (CatalogHeader *) base;
+    
+    if (header->fileID != kCatalogFileID || header->version != kCatalogVersion) {
+        fprintf(stderr, "ERROR: %s is not an affix catalog file, or was written on a machine with a different byte order\n", catalogName);
+        exit(-1);
+    }
+    
+    // Every offset and size is checked against the file size before it is used, the sizes one at a time so that
+    // a damaged header can't overflow the sums.
+    
+    if (header->numRows > sb.st_size / sizeof(UInt64) ||
+        header->nameHeapOffset > sb.st_size || header->nameHeapSize > sb.st_size - header->nameHeapOffset ||
+        header->nameOffsetsOffset > header->nameHeapOffset ||
+        header->numRows * sizeof(UInt64) > header->nameHeapOffset - header->nameOffsetsOffset) {
+        fprintf(stderr, "ERROR: %s: catalog file is truncated or damaged\n", catalogName);
+        exit(-1);
+    }
+    
+    for (int column = 0; column < kCatalogColumns; column++) {
+        if (header->columnOffsets[column] > sb.st_size ||
+            header->numRows * catalogColumnWidths[column] > sb.st_size - header->columnOffsets[column]) {
+            fprintf(stderr, "ERROR: %s: catalog file is truncated or damaged\n", catalogName);
+            exit(-1);
+        }
+        catalogData[column] = base + header->columnOffsets[column];
+    }
+    
+    catalogRows         = header->numRows;
+    catalogNameOffsets  = (UInt64 *) (base + header->nameOffsetsOffset);
+    catalogNameHeap     = (char *) (base + header->nameHeapOffset);
+    catalogNameHeapSize = header->nameHeapSize;
+    
+    // Names are printed straight from the heap, each one has to start inside it and the last has to be terminated.
+    
+    if (catalogRows > 0 && (catalogNameHeapSize == 0 || catalogNameHeap[catalogNameHeapSize - 1] != '\0')) {
+        fprintf(stderr, "ERROR: %s: catalog file is damaged, file name heap is not terminated\n", catalogName);
+        exit(-1);
+    }
+    
+    for (size_t row = 0; row < catalogRows; row++) {
+        if (catalogNameOffsets[row] >= catalogNameHeapSize) {
+            fprintf(stderr, "ERROR: %s: catalog file is damaged, file name %zu is outside the name heap\n", catalogName, row);
+            exit(-1);
+        }
+    }
+    
+    // Let the kernel read the columns ahead, a query touches every page of the columns it uses.
+    madvise(base, header->nameOffsetsOffset, MADV_SEQUENTIAL);
+}
+
+
+int newQueryNode(QueryNodeType type) {
+    
+    if (numQueryNodes == kQueryMaxNodes) {
+        queryError("query is too long");
+    }
+    
+    memset(&queryNodes[numQueryNodes], 0, sizeof(QueryNode));
+    queryNodes[numQueryNodes].type = type;
+    
+    return numQueryNodes++;
+}
+
+
+void skipQuerySpace(void) {
+    
+    while (isspace((unsigned char) *queryPosition)) {
+        queryPosition++;
+    }
+}
+
+
+void queryError(const char * message) {
+    
+    fprintf(stderr, "query: %s at column %ld: %s\n", message, (long) (queryPosition - queryText) + 1, queryText);
+    exit(-1);
+}
+
+
+int parseQueryOr(void) {
+    
+    // or     := and { "||" and }
+    
+    int node = parseQueryAnd();
+    
+    for (skipQuerySpace(); strncmp(queryPosition, "||", 2) == 0; skipQuerySpace()) {
+        queryPosition += 2;
+        int right = parseQueryAnd();
+        int left = node;
+        node = newQueryNode(kQueryOr);
+        queryNodes[node].left  = left;
+        queryNodes[node].right = right;
+    }
+    
+    return node;
+}
+
+
+int parseQueryAnd(void) {
+    
+    // and    := unary { "&&" unary }
+    
+    int node = parseQueryUnary();
+    
+    for (skipQuerySpace(); strncmp(queryPosition, "&&", 2) == 0; skipQuerySpace()) {
+        queryPosition += 2;
+        int right = parseQueryUnary();
+        int left = node;
+        node = newQueryNode(kQueryAnd);
+        queryNodes[node].left  = left;
+        queryNodes[node].right = right;
+    }
+    
+    return node;
+}
+
+
+int parseQueryUnary(void) {
+    
+    // unary  := "!" unary | "(" or ")" | comparison
+    
+    skipQuerySpace();
+    
+    if (*queryPosition == '!' && queryPosition[1] != '=') {
+        queryPosition++;
+        int operand = parseQueryUnary();
+        int node = newQueryNode(kQueryNot);
+        queryNodes[node].left = operand;
+        return node;
+    }
+    
+    if (*queryPosition == '(') {
+        queryPosition++;
+        int node = parseQueryOr();
+        skipQuerySpace();
+        if (*queryPosition != ')') {
+            queryError("expected )");
+        }
+        queryPosition++;
+        return node;
+    }
+    
+    return parseQueryComparison();
+}
+
+
+int parseQueryComparison(void) {
+    
+    // comparison := field op value
+    // field  := rate | channels | frames | bits | form | compression
+    // op     := == | != | < | <= | > | >=
+    // value  := number | four character code, bare (AIFC, sowt) or quoted ('fl32', "NONE")
+    
+    static const char * operators[] = { "==", "!=", "<=", ">=", "<", ">" };
+    static const QueryOperator operatorCodes[] = { kQueryEQ, kQueryNE, kQueryLE, kQueryGE, kQueryLT, kQueryGT };
+    int node = newQueryNode(kQueryCompare);
+    int column;
+    size_t length;
+    
+    skipQuerySpace();
+    
+    for (length = 0; isalpha((unsigned char) queryPosition[length]); length++) {
+    }
+    
+    for (column = 0; column < kCatalogColumns; column++) {
+        if (length == strlen(catalogColumnNames[column]) && strncmp(queryPosition, catalogColumnNames[column], length) == 0) {
+            break;
+        }
+    }
+    
+    if (column == kCatalogColumns) {
+        queryError("expected rate, channels, frames, bits, form or compression");
+    }
+    
+    queryNodes[node].column = column;
+    queryPosition += length;
+    skipQuerySpace();
+    
+    int op;
+    
+    for (op = 0; op < sizeof(operators) / sizeof(operators[0]); op++) {
+        if (strncmp(queryPosition, operators[op], strlen(operators[op])) == 0) {
+            break;
+        }
+    }
+    
+    if (op == sizeof(operators) / sizeof(operators[0])) {
+        queryError("expected ==, !=, <, <=, > or >=");
+    }
+    
+    queryNodes[node].op = operatorCodes[op];
+    queryPosition += strlen(operators[op]);
+    skipQuerySpace();
+    
+    if (*queryPosition == '\'' || *queryPosition == '"' || isalpha((unsigned char) *queryPosition)) {
+        
+        // Four character code, shorter codes are padded with spaces as in 'GSM '
+        
+        char quote = isalpha((unsigned char) *queryPosition) ? '\0' : *queryPosition++;
+        UInt32 code = 0;
+        int n;
+        
+        for (n = 0; n < 4 && *queryPosition != '\0' && (quote ? *queryPosition != quote : isalnum((unsigned char) *queryPosition)); n++) {
+            code = (code << 8) | (UInt8) *queryPosition++;
+        }
+        
+        for (; n < 4; n++) {
+            code = (code << 8) | ' ';
+        }
+        
+        if (quote) {
+            if (*queryPosition != quote) {
+                queryError("expected closing quote after four character code");
+            }
+            queryPosition++;
+        }
+        else if (isalnum((unsigned char) *queryPosition)) {
+            queryError("four character code is too long");
+        }
+        
+        queryNodes[node].value = code;
+    }
+    else {
+        char * end;
+        queryNodes[node].value = strtod(queryPosition, &end);
+        if (end == queryPosition) {
+            queryError("expected a number or four character code");
+        }
+        queryPosition = end;
+    }
+    
+    return node;
+}
+
+
+void evaluateQuery(int node, size_t firstRow, size_t numRows, UInt8 ** masks, double * scratch) {
+    
+    // Evaluate node over rows firstRow .. firstRow + numRows - 1 into masks[node], one byte per row.
+    
+    UInt8 * mask = masks[node];
+    QueryNode * q = &queryNodes[node];
+    
+    switch (q->type) {
+            
+        case kQueryCompare: {
+            
+            const void * data = catalogData[q->column];
+            double value = q->value;
+            
+            switch (q->column) {
+                case kColumnNumChannels:
+                case kColumnSampleSize:
+                    for (size_t i = 0; i < numRows; i++) {
+                        scratch[i] = ((const UInt16 *) data)[firstRow + i];
+                    }
+                    break;
+                case kColumnSampleRate:
+                    memcpy(scratch, (const double *) data + firstRow, numRows * sizeof(double));
+                    break;
+                default:
+                    for (size_t i = 0; i < numRows; i++) {
+                        scratch[i] = ((const UInt32 *) data)[firstRow + i];
+                    }
+                    break;
+            }
+            
+            switch (q->op) {
+                case kQueryEQ:
+                    for (size_t i = 0; i < numRows; i++) mask[i] = scratch[i] == value;
+                    break;
+                case kQueryNE:
+                    for (size_t i = 0; i < numRows; i++) mask[i] = scratch[i] != value;
+                    break;
+                case kQueryLT:
+                    for (size_t i = 0; i < numRows; i++) mask[i] = scratch[i] <  value;
+                    break;
+                case kQueryLE:
+                    for (size_t i = 0; i < numRows; i++) mask[i] = scratch[i] <= value;
+                    break;
+                case kQueryGT:
+                    for (size_t i = 0; i < numRows; i++) mask[i] = scratch[i] >  value;
+                    break;
+                case kQueryGE:
+                    for (size_t i = 0; i < numRows; i++) mask[i] = scratch[i] >= value;
+                    break;
+            }
+            break;
+        }
+            
+        case kQueryAnd:
+        case kQueryOr: {
+            
+            evaluateQuery(q->left, firstRow, numRows, masks, scratch);
+            evaluateQuery(q->right, firstRow, numRows, masks, scratch);
+            
+            const UInt8 * left = masks[q->left];
+            const UInt8 * right = masks[q->right];
+            
+            if (q->type == kQueryAnd) {
+                for (size_t i = 0; i < numRows; i++) mask[i] = left[i] & right[i];
+            }
+            else {
+                for (size_t i = 0; i < numRows; i++) mask[i] = left[i] | right[i];
+            }
+            break;
+        }
+            
+        case kQueryNot: {
+            
+            evaluateQuery(q->left, firstRow, numRows, masks, scratch);
+            
+            const UInt8 * operand = masks[q->left];
+            
+            for (size_t i = 0; i < numRows; i++) mask[i] = operand[i] ^ 1;
+            break;
+        }
+    }
+}
+
+
+int queryCommand(int argc, const char * argv[]) {
+    
+    // affix query [-v] -k catalog 'predicate'
+    // Prints the names of catalog files matching predicate, or with -v the same columns as a -v scan.
+    
+    const char * queryCatalogName = NULL;
+    int c;
+    
+    while ((c = getopt(argc, (char * const *) argv, "dk:vh")) != -1) {
+        switch (c) {
+            case 'd':
+                debugOpt = TRUE;
+                break;
+            case 'k':
+                queryCatalogName = optarg;
+                break;
+            case 'v':
+                verboseOpt = TRUE;
+                break;
+            default:
+                usage(programName);
+                return 1;
+        }
+    }
+    
+    if (queryCatalogName == NULL || optind != argc - 1) {
+        fprintf(stderr, "usage: affix query [-v] -k catalog 'predicate', e.g. affix query -k lib.catalog 'rate != 48000 && channels == 2'\n");
+        return 1;
+    }
+    
+    queryText = queryPosition = argv[optind];
+    
+    int root = parseQueryOr();
+    
+    skipQuerySpace();
+    
+    if (*queryPosition != '\0') {
+        queryError("unexpected text");
+    }
+    
+    mapCatalogFile(queryCatalogName);
+    
+    UInt8 ** masks = calloc(numQueryNodes, sizeof(UInt8 *));
+    double * scratch = malloc(kQueryChunkRows * sizeof(double));
+    size_t numMatches = 0;
+    
+    for (int n = 0; n < numQueryNodes; n++) {
+        if ((masks[n] = malloc(kQueryChunkRows)) == NULL) {
+            fprintf(stderr, "ERROR: malloc() of query masks failed\n");
+            return -1;
+        }
+    }
+    
+    for (size_t firstRow = 0; firstRow < catalogRows; firstRow += kQueryChunkRows) {
+        
+        size_t numRows = catalogRows - firstRow < kQueryChunkRows ? catalogRows - firstRow : kQueryChunkRows;
+        
+        evaluateQuery(root, firstRow, numRows, masks, scratch);
+        
+        for (size_t i = 0; i < numRows; i++) {
+            
+            if (!masks[root][i]) {
+                continue;
+            }
+            
+            size_t row = firstRow + i;
+            const char * rowFileName = catalogNameHeap + catalogNameOffsets[row];
+            
+            numMatches++;
+            
+            if (verboseOpt) {
+                
+                // Same columns as a -v scan, except AIFF-C files show the compression type rather than its name.
+                
+                UInt32 formType = ((const UInt32 *) catalogData[kColumnFormType])[row];
+                UInt32 compressionType = ((const UInt32 *) catalogData[kColumnCompressionType])[row];
+                char formString[5], compressionString[5];
+                
+                snprintf(formString, sizeof(formString), "%c%c%c%c", formType >> 24, formType >> 16, formType >> 8, formType);
+                snprintf(compressionString, sizeof(compressionString), "%c%c%c%c", compressionType >> 24, compressionType >> 16, compressionType >> 8, compressionType);
+                
+                printf("%s\t%d\t%u\t%d\t%.0f\t%s\t%s\n",
+                       rowFileName,
+                       ((const UInt16 *) catalogData[kColumnNumChannels])[row],
+                       ((const UInt32 *) catalogData[kColumnNumSampleFrames])[row],
+                       ((const UInt16 *) catalogData[kColumnSampleSize])[row],
+                       ((const double *) catalogData[kColumnSampleRate])[row],
+                       formString,
+                       formType == AIFFID ? "not compressed" : compressionString);
+            }
+            else {
+                printf("%s\n", rowFileName);
+            }
+        }
+    }
+    
+    if (debugOpt) {
+        fprintf(stderr, "DEBUG: %zu of %zu catalog files matched\n", numMatches, catalogRows);
+    }
+    
+    return 0;
+}
+
+
+UInt32 hashString(const char * string) {
+    
+    // FNV-1a. Picks each file's shard, so it must give the same answer on every machine taking part in a run.
+    
+    UInt32 hash = 2166136261u;
+    
+    for (const unsigned char * p = (const unsigned char *) string; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    
+    return hash;
+}
+
+
+void resultPrintf(const char * format, ...) {
+    
+    // printf() into resultBuffer, growing it as needed.
+    
+    va_list args;
+    int length;
+    
+    va_start(args, format);
+    length = vsnprintf(resultBuffer + resultLength, resultCapacity - resultLength, format, args);
+    va_end(args);
+    
+    if (length < 0) {
+        return;
+    }
+    
+    if (resultLength + length >= resultCapacity) {
+        
+        size_t newCapacity = 2 * (resultLength + length + 1);
+        char * newBuffer = realloc(resultBuffer, newCapacity);
+        
+        if (newBuffer == NULL) {
+            fprintf(stderr, "realloc(resultBuffer, %lu) failed\n", newCapacity);
+            exit(-1);
+        }
+        
+        resultBuffer = newBuffer;
+        resultCapacity = newCapacity;
+        
+        va_start(args, format);
+        vsnprintf(resultBuffer + resultLength, resultCapacity - resultLength, format, args);
+        va_end(args);
+    }
+    
+    resultLength += length;
+}
+
+
+UInt32 checkpointOptionsHash(unsigned int resetRate) {
+    
+    // Hash of the options that change what is recorded for a file. -S, -C and the I/O budget options don't,
+    // shards of one run differ only in -S.
+    
+    char options[128];
+    
+    snprintf(options, sizeof(options), "v%d d%d n%d x%d p%d s%u c%u",
+             verboseOpt, debugOpt, noWriteOpt, verifyOpt, peaksOpt, resetRate, convertOpt ? convertRate : 0);
+    
+    return hashString(options);
+}
+
+
+long readCheckpointFile(const char * checkpointName, CheckpointRecord ** records, UInt32 * optionsHash, off_t * completeLength) {
+    
+    // Read every complete record in a checkpoint file and the options hash it was written with. The record strings
+    // point into a buffer holding the whole file that is never freed. Returns the number of records, or -1 if the
+    // file does not exist. An incomplete last record is ignored, completeLength is the length of the file without it
+    // for a resuming run to cut it off before appending. Merging must not truncate, the record may be one a shard
+    // that is still running is part way through writing.
+    
+    struct stat sb;
+    int fd;
+    char * buffer;
+    
+    if ((fd = throttledOpen(checkpointName, O_RDONLY, 0)) == -1) {
+        if (errno == ENOENT) {
+            return -1;
+        }
+        fprintf(stderr, "ERROR: %s: %s, can not read checkpoint file\n", checkpointName, strerror(errno));
+        exit(-1);
+    }
+    
+    if (fstat(fd, &sb) == -1 || (buffer = malloc(sb.st_size + 1)) == NULL) {
+        fprintf(stderr, "ERROR: %s: can not read checkpoint file\n", checkpointName);
+        exit(-1);
+    }
+    
+    if (read(fd, buffer, sb.st_size) != sb.st_size) {
+        fprintf(stderr, "ERROR: %s: %s, checkpoint file read failed\n", checkpointName, strerror(errno));
+        exit(-1);
+    }
+    
+    close(fd);
+    buffer[sb.st_size] = '\0';
+    
+    char * p = buffer + sizeof(checkpointMagic);
+    int headerChars = 0;
+    
+    if (sb.st_size < sizeof(checkpointMagic) || memcmp(buffer, checkpointMagic, sizeof(checkpointMagic)) != 0 ||
+        sscanf(p, "options %8x%n", optionsHash, &headerChars) != 1 || p + headerChars >= buffer + sb.st_size || p[headerChars] != '\0') {
+        fprintf(stderr, "ERROR: %s is not an affix checkpoint file, or was written by an older version\n", checkpointName);
+        exit(-1);
+    }
+    
+    p += headerChars + 1;
+    char * headerEnd = p;
+    char * end = buffer + sb.st_size;
+    long numRecords = 0;
+    long capacity = 1024;
+    
+    *records = malloc(capacity * sizeof(CheckpointRecord));
+    
+    while (p < end) {
+        
+        char * fields[3];
+        int f;
+        
+        for (f = 0; f < 3 && p < end; f++) {
+            fields[f] = p;
+            p += strlen(p) + 1;
+        }
+        
+        if (f < 3 || p > end) {
+            break;          // record cut short
+        }
+        
+        if (numRecords == capacity) {
+            capacity *= 2;
+            *records = realloc(*records, capacity * sizeof(CheckpointRecord));
+        }
+        
+        if (*records == NULL) {
+            fprintf(stderr, "ERROR: %s: out of memory reading checkpoint file\n", checkpointName);
+            exit(-1);
+        }
+        
+        (*records)[numRecords].argIndex = strtol(fields[0], NULL, 10);
+        (*records)[numRecords].fileName = fields[1];
+        (*records)[numRecords].result   = fields[2];
+        numRecords++;
+    }
+    
+    off_t validLength = headerEnd - buffer;
+    
+    if (numRecords > 0) {
+        CheckpointRecord * last = &(*records)[numRecords - 1];
+        validLength = (last->result + strlen(last->result) + 1) - buffer;
+    }
+    
+    if (validLength < sb.st_size) {
+        fprintf(stderr, "%s: ignoring incomplete last checkpoint record\n", checkpointName);
+    }
+    *completeLength = validLength;
+    
+    return numRecords;
+}
+
+
+void openCheckpointFile(const char * checkpointName, UInt32 optionsHash) {
+    
+    // Load the files an earlier run with the same options finished, then open the checkpoint file to append to.
+    
+    CheckpointRecord * records;
+    UInt32 fileOptionsHash;
+    off_t completeLength;
+    long numRecords = readCheckpointFile(checkpointName, &records, &fileOptionsHash, &completeLength);
+    
+    if (numRecords < 0) {
+        if ((checkpointFile = fopen(checkpointName, "w")) == NULL) {
+            fprintf(stderr, "ERROR: %s: %s, can not create checkpoint file\n", checkpointName, strerror(errno));
+            exit(-1);
+        }
+        fwrite(checkpointMagic, 1, sizeof(checkpointMagic), checkpointFile);
+        fprintf(checkpointFile, "options %08x%c", optionsHash, '\0');
+        fflush(checkpointFile);
+        return;
+    }
+    
+    // Checked before anything is truncated, a checkpoint given by mistake is left as it was.
+    
+    if (fileOptionsHash != optionsHash) {
+        fprintf(stderr, "ERROR: %s was written by a run with different options (-v, -d, -n, -x, -p, -s or -c), can not resume from it\n", checkpointName);
+        exit(-1);
+    }
+    
+    if (truncate(checkpointName, completeLength) == -1) {
+        fprintf(stderr, "ERROR: %s: %s, truncate() of checkpoint file failed\n", checkpointName, strerror(errno));
+    }
+    
+    checkpointTableSize = 64;
+    while (checkpointTableSize < 2 * numRecords) {
+        checkpointTableSize *= 2;
+    }
+    
+    checkpointTable = calloc(checkpointTableSize, sizeof(CheckpointRecord));
+    
+    for (long r = 0; r < numRecords; r++) {
+        addCompletedFile(records[r].argIndex, records[r].fileName, records[r].result);
+    }
+    
+    free(records);
+    
+    if (verboseOpt || debugOpt) {
+        fprintf(stderr, "%s: resuming, %zu files already done\n", checkpointName, checkpointTableCount);
+    }
+    
+    if ((checkpointFile = fopen(checkpointName, "a")) == NULL) {
+        fprintf(stderr, "ERROR: %s: %s, can not append to checkpoint file\n", checkpointName, strerror(errno));
+        exit(-1);
+    }
+}
+
+
+void addCompletedFile(long argIndex, char * completedFileName, char * result) {
+    
+    if (2 * (checkpointTableCount + 1) > checkpointTableSize) {
+        
+        CheckpointRecord * oldTable = checkpointTable;
+        size_t oldSize = checkpointTableSize;
+        
+        checkpointTableSize *= 2;
+        checkpointTable = calloc(checkpointTableSize, sizeof(CheckpointRecord));
+        checkpointTableCount = 0;
+        
+        for (size_t i = 0; i < oldSize; i++) {
+            if (oldTable[i].fileName != NULL) {
+                addCompletedFile(oldTable[i].argIndex, oldTable[i].fileName, oldTable[i].result);
+            }
+        }
+        
+        free(oldTable);
+    }
+    
+    size_t i = hashString(completedFileName) & (checkpointTableSize - 1);
+    
+    while (checkpointTable[i].fileName != NULL) {
+        if (strcmp(checkpointTable[i].fileName, completedFileName) == 0) {
+            checkpointTable[i].result = result;     // later record wins
+            return;
+        }
+        i = (i + 1) & (checkpointTableSize - 1);
+    }
+    
+    checkpointTable[i].argIndex = argIndex;
+    checkpointTable[i].fileName = completedFileName;
+    checkpointTable[i].result   = result;
+    checkpointTableCount++;
+}
+
+
+const char * completedFileResult(const char * completedFileName) {
+    
+    // Output recorded for a file finished by an earlier run, NULL if it still needs doing.
+    
+    if (checkpointTable == NULL) {
+        return NULL;
+    }
+    
+    size_t i = hashString(completedFileName) & (checkpointTableSize - 1);
+    
+    while (checkpointTable[i].fileName != NULL) {
+        if (strcmp(checkpointTable[i].fileName, completedFileName) == 0) {
+            return checkpointTable[i].result;
+        }
+        i = (i + 1) & (checkpointTableSize - 1);
+    }
+    
+    return NULL;
+}
+
+
+void recordCheckpoint(long argIndex, const char * completedFileName, const char * result) {
+    
+    // Append a finished file. Flushed every record so a killed process loses nothing, synced to disk every
+    // kCheckpointSyncInterval records to bound what a machine crash can lose. Called from conversion threads too.
+    
+    if (checkpointFile == NULL) {
+        return;
+    }
+    
+    pthread_mutex_lock(&checkpointMutex);
+    
+    fprintf(checkpointFile, "%ld%c%s%c%s%c", argIndex, '\0', completedFileName, '\0', result, '\0');
+    
+    if (fflush(checkpointFile) != 0) {
+        fprintf(stderr, "ERROR: %s: %s, checkpoint file write failed\n", checkpointFileName, strerror(errno));
+        exit(-1);
+    }
+    
+    if (++checkpointUnsynced >= kCheckpointSyncInterval) {
+        fsync(fileno(checkpointFile));
+        checkpointUnsynced = 0;
+    }
+    
+    pthread_mutex_unlock(&checkpointMutex);
+}
+
+
+void closeCheckpointFile(void) {
+    
+    if (checkpointFile == NULL) {
+        return;
+    }
+    
+    fflush(checkpointFile);
+    fsync(fileno(checkpointFile));
+    fclose(checkpointFile);
+    checkpointFile = NULL;
+}
+
+
+int compareCheckpointRecords(const void * a, const void * b) {
+    
+    const CheckpointRecord * ra = (const CheckpointRecord *) a;
+    const CheckpointRecord * rb = (const CheckpointRecord *) b;
+    
+    if (ra->argIndex != rb->argIndex) {
+        return ra->argIndex < rb->argIndex ? -1 : 1;
+    }
+    
+    return strcmp(ra->fileName, rb->fileName);
+}
+
+
+void mergeCheckpointFiles(int numFiles, const char * checkpointNames[]) {
+    
+    // Print the combined output of the shards' checkpoint files in original argument order,
+    // the same as a single unsharded run over the same file arguments would have printed.
+    
+    CheckpointRecord * all = NULL;
+    long numAll = 0;
+    UInt32 firstOptionsHash = 0;
+    
+    for (int f = 0; f < numFiles; f++) {
+        
+        CheckpointRecord * records;
+        UInt32 optionsHash;
+        off_t completeLength;
+        long numRecords = readCheckpointFile(checkpointNames[f], &records, &optionsHash, &completeLength);
+        
+        if (numRecords < 0) {
+            fprintf(stderr, "ERROR: %s does not exist\n", checkpointNames[f]);
+            exit(-1);
+        }
+        
+        if (f == 0) {
+            firstOptionsHash = optionsHash;
+        }
+        else if (optionsHash != firstOptionsHash) {
+            fprintf(stderr, "ERROR: %s and %s were written by runs with different options (-v, -d, -n, -x, -p, -s or -c), can not merge them\n",
+                    checkpointNames[0], checkpointNames[f]);
+            exit(-1);
+        }
+        
+        if ((all = realloc(all, (numAll + numRecords + 1) * sizeof(CheckpointRecord))) == NULL) {
+            fprintf(stderr, "ERROR: out of memory merging checkpoint files\n");
+            exit(-1);
+        }
+        
+        memcpy(all + numAll, records, numRecords * sizeof(CheckpointRecord));
+        numAll += numRecords;
+        free(records);
+    }
+    
+    qsort(all, numAll, sizeof(CheckpointRecord), compareCheckpointRecords);
+    
+    for (long r = 0; r < numAll; r++) {
+        
+        if (r > 0 && all[r].argIndex == all[r - 1].argIndex) {
+            if (strcmp(all[r].fileName, all[r - 1].fileName) != 0) {
+                fprintf(stderr, "%s and %s: same argument position %ld, were the shards run with the same file arguments?\n",
+                        all[r - 1].fileName, all[r].fileName, all[r].argIndex);
+            }
+            else {
+                continue;   // same file recorded twice
+            }
+        }
+        
+        fputs(all[r].result, stdout);
+    }
+    
+    free(all);
+}
+
+
 void usage(const char * ourNameString) {
     printf("\
-%s [-vVh] [-s sampleRate] aiff_file1 ... aiff_filen\n\
+%s [-vVhpx] [-s sampleRate | -c sampleRate] [-S i/N] [-C checkpoint] [-k catalog]\n\
+      [-I iops] [-B bytesPerSecond] [-L latency] [-P priority] aiff_file1 ... aiff_filen\n\
+%s -M checkpoint1 ... checkpointn\n\
+%s query [-v] -k catalog predicate\n\
+%s tag [-n] [-N name] [-A author] [-R copyright] [-m comment] [-a annotation]\n\
+      aiff_file1 ... aiff_filen\n\
+%s split [-n] aiff_file position1 ... positionn\n\
+%s trim [-n] -o out_file aiff_file start end\n\
+%s concat [-n] -o out_file aiff_file1 ... aiff_filen\n\
 Print AIFF or AIFF-C file(s) sample rate, optionally other information, and\n\
 optionally reset the sample rate. The standard output consists of a line of\n\
 the following tab separated values:\n\
@@ -748,6 +4869,43 @@ the following tab separated values:\n\
                     sample rate\n\
 Options:\n\
  -s sampleRate   Reset file(s) sample rate to integer value sampleRate.\n\
+ -c sampleRate   Convert file(s) sample data to integer sample rate sampleRate,\n\
+                 writing a new file alongside each original with the rate\n\
+                 added to the name, e.g. sound.aif -> sound-48000.aif.\n\
+                 Handles 8-32 bit integer and AIFF-C float sample data.\n\
+                 With -n the conversion is run but nothing is written.\n\
+ -p              Peaks. Write a waveform overview file aiff_file.peaks with\n\
+                 the minimum and maximum of each channel for every 256, 1024\n\
+                 and 4096 sample frames. With -n nothing is written.\n\
+ -x              Verify. Check each file is as long as its chunk sizes claim,\n\
+                 that 'SSND' holds the number of sample frames 'COMM' claims,\n\
+                 and that the sample data has no unwritten holes left by an\n\
+                 interrupted copy, and reports missing or repeated chunks.\n\
+                 Adds a line per problem found, or\n\
+                    filename  verify  ok\n\
+                 Sample data is not read, so this is nearly as fast as a scan.\n\
+ -S i/N          Shard. Only process the files in shard i of N (0 <= i < N).\n\
+                 Each file's shard depends only on its name, so N machines\n\
+                 given the same file arguments split the work between them.\n\
+ -C checkpoint   Record each finished file and its output in file checkpoint.\n\
+                 If checkpoint already exists the files it records are not\n\
+                 processed again, their recorded output is printed instead.\n\
+                 The options -v, -d, -n, -x, -p, -s and -c must be the same.\n\
+ -M              Merge. Print the combined output recorded in the checkpoint\n\
+                 files given as arguments, in the original file order.\n\
+ -k catalog      Write the channels, frames, bits, rate, form and compression\n\
+                 of every valid file scanned to file catalog, for query.\n\
+                 Can not be used with -S or -C.\n\
+ -I iops         Limit file I/O to iops operations per second. Every stat(),\n\
+                 access(), open(), read and write counts as one operation.\n\
+ -B bytesPerSecond\n\
+                 Limit file I/O to bytesPerSecond, which can be followed by\n\
+                 k, m or g, e.g. -B 20m.\n\
+ -L latency      With -I or -B, slow down further while the average read\n\
+                 latency is over latency milliseconds, speeding back up to the\n\
+                 -I/-B limits as latency recovers.\n\
+ -P priority     Disk I/O priority, one of important, standard, utility,\n\
+                 throttle or passive. See setiopolicy_np(3).\n\
  -v              verbose output. Output consist of a line of following tab\n\
                  separated values:\n\
                     filename\n\
@@ -760,13 +4918,44 @@ Options:\n\
  -V              Version. Display version of this program, copyright, and \n\
                  license information.\n\
  -h              help. Display this help message.\n\
+Query:\n\
+ Print the names of the files in catalog matching predicate, or with -v the\n\
+ same columns as -v above. predicate compares rate, channels, frames, bits,\n\
+ form or compression with ==, !=, <, <=, > or >= to a number or four character\n\
+ code, combined with &&, ||, ! and parentheses.\n\
+Tag:\n\
+ Set the NAME, AUTH, (c) , COMT (one comment, stamped with the current time)\n\
+ and ANNO (all annotations replaced by one) text chunks. Empty text removes\n\
+ the chunk. Files are edited in place when the text fits, otherwise the text\n\
+ is added at the end of the file with padding for later edits. With -n\n\
+ nothing is written.\n\
+Split, trim and concat:\n\
+ Copy sample frames to new files without decoding them. split writes\n\
+ aiff_file-1.aif up to position1, aiff_file-2.aif from there to position2\n\
+ and so on. trim writes the frames from start up to end. concat joins files\n\
+ with the same channels, bits, rate and compression. Positions are sample\n\
+ frame numbers, or seconds followed by s, e.g. 90.5s. Only the sample\n\
+ data is kept, not markers or text chunks. split and trim clone the\n\
+ file where the volume supports it (APFS) instead of copying the data.\n\
+ Compression types other than uncompressed, float, ulaw and alaw are not\n\
+ supported. With -n nothing is written.\n\
 \n\
  e.g. affix music.aiff \n\
       affix -v sound.AIFF \n\
       affix -vs 96000 sound2.aifc \n\
       affix -v -s 192000 sound3.aif \n\
+      affix -c 48000 take1.aif take2.aif \n\
+      affix -v -S 0/2 -C shard0 *.aif (and -S 1/2 -C shard1 on another machine) \n\
+      affix -M shard0 shard1 \n\
+      affix -I 200 -B 10m -L 20 -P utility /Volumes/Audio/*.aif \n\
+      affix -x /Volumes/Audio/*.aif | grep -v 'verify.ok$' \n\
+      affix -k library.catalog /Volumes/Audio/*.aif \n\
+      affix query -k library.catalog 'rate != 48000 && channels == 2 && bits == 24' \n\
+      affix tag -A \"Jane Doe\" -R \"(c) 2024 Jane Doe\" /Volumes/Audio/*.aif \n\
+      affix split session.aif 720s 1500s \n\
+      affix concat -o session.aif take1.aif take2.aif \n\
       affix -v * (reports verbose information for all files matched by *) \n\
-\n", ourNameString);
+\n", ourNameString, ourNameString, ourNameString, ourNameString, ourNameString, ourNameString, ourNameString);
     exit(1);
 }
 